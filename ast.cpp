@@ -8,3 +8,43 @@
 FuncOrProtoDecl::~FuncOrProtoDecl()
 {
 }
+
+// -----------------------------------------------------------------------------
+std::shared_ptr<Expr> ExprFactory::Ref(const std::string &name)
+{
+  auto &ref = refs_[name];
+  if (!ref) {
+    ref = std::make_shared<RefExpr>(name);
+    shared_.insert(ref.get());
+  }
+  return ref;
+}
+
+// -----------------------------------------------------------------------------
+std::shared_ptr<Expr> ExprFactory::Int(uint64_t number)
+{
+  auto &expr = ints_[number];
+  if (!expr) {
+    expr = std::make_shared<IntExpr>(number);
+    shared_.insert(expr.get());
+  }
+  return expr;
+}
+
+// -----------------------------------------------------------------------------
+std::shared_ptr<Expr> ExprFactory::Binary(
+    BinaryExpr::Kind kind,
+    std::shared_ptr<Expr> lhs,
+    std::shared_ptr<Expr> rhs)
+{
+  // Expressions with calls are unique, as are all their parents.
+  if (!shared_.count(lhs.get()) || !shared_.count(rhs.get())) {
+    return std::make_shared<BinaryExpr>(kind, lhs, rhs);
+  }
+  auto &expr = binaries_[{ kind, lhs.get(), rhs.get() }];
+  if (!expr) {
+    expr = std::make_shared<BinaryExpr>(kind, lhs, rhs);
+    shared_.insert(expr.get());
+  }
+  return expr;
+}
@@ -2,7 +2,12 @@
 
 #pragma once
 
+#include <cassert>
+#include <map>
 #include <string>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <memory>
 #include <variant>
@@ -24,8 +29,10 @@ public:
     WHILE,
     IF,
     LET,
+    ASSIGN,
     EXPR,
-    RETURN
+    RETURN,
+    YIELD
   };
 
 public:
@@ -48,7 +55,8 @@ public:
     REF,
     BINARY,
     CALL,
-    INT
+    INT,
+    FUNC
   };
 
 public:
@@ -152,6 +160,38 @@ private:
 
 };
 
+/**
+ * Factory building hash-consed expressions.
+ *
+ * Structurally identical expressions which do not contain calls are built
+ * only once and shared by all their occurrences. Since names are shared
+ * regardless of the declarations they refer to, an expression node can
+ * appear in multiple scopes: analyses recording facts about nodes must
+ * ensure that the facts hold in all contexts.
+ */
+class ExprFactory final {
+public:
+  /// Returns a reference to a name.
+  std::shared_ptr<Expr> Ref(const std::string &name);
+  /// Returns an integer constant.
+  std::shared_ptr<Expr> Int(uint64_t number);
+  /// Returns a binary expression, shared if its operands are shared.
+  std::shared_ptr<Expr> Binary(
+      BinaryExpr::Kind kind,
+      std::shared_ptr<Expr> lhs,
+      std::shared_ptr<Expr> rhs);
+
+private:
+  /// Unique references, indexed by name.
+  std::unordered_map<std::string, std::shared_ptr<Expr>> refs_;
+  /// Unique constants, indexed by value.
+  std::unordered_map<uint64_t, std::shared_ptr<Expr>> ints_;
+  /// Unique binary expressions, indexed by operator and operands.
+  std::map<std::tuple<BinaryExpr::Kind, const Expr *, const Expr *>, std::shared_ptr<Expr>> binaries_;
+  /// Set of all shared nodes.
+  std::unordered_set<const Expr *> shared_;
+};
+
 /**
  * Block statement composed of a sequence of statements.
  */
@@ -210,6 +250,26 @@ private:
   std::shared_ptr<Expr> expr_;
 };
 
+/**
+ * Yield statement, suspending a generator with a value.
+ *
+ * yield <expr>
+ */
+class YieldStmt final : public Stmt {
+public:
+  YieldStmt(std::shared_ptr<Expr> expr)
+    : Stmt(Kind::YIELD)
+    , expr_(expr)
+  {
+  }
+
+  const Expr &GetExpr() const { return *expr_; }
+
+private:
+  /// Expression to be produced.
+  std::shared_ptr<Expr> expr_;
+};
+
 /**
  * While statement.
  *
@@ -290,6 +350,30 @@ private:
   std::shared_ptr<Expr> initialization_;
 };
 
+/**
+ * Assignment to an argument or a local.
+ *
+ * a = ...
+ */
+class AssignStmt final : public Stmt {
+public:
+  AssignStmt(const std::string &name, std::shared_ptr<Expr> expr)
+    : Stmt(Kind::ASSIGN)
+    , name_(name)
+    , expr_(expr)
+  {
+  }
+
+  const std::string &GetName() const { return name_; }
+  const Expr &GetExpr() const { return *expr_; }
+
+private:
+  /// Name of the variable.
+  std::string name_;
+  /// Value assigned to the variable.
+  std::shared_ptr<Expr> expr_;
+};
+
 /**
  * Base class for internal and external function declarations.
  */
@@ -297,20 +381,45 @@ class FuncOrProtoDecl : public Node {
 public:
   using ArgList = std::vector<std::pair<std::string, std::string>>;
 
+  /// Attributes attached to a declaration: @pure, @noinline, @hot, @cold.
+  enum class Attr {
+    PURE,
+    NOINLINE,
+    HOT,
+    COLD
+  };
+
+  /// Set of attributes, as a bit mask indexed by Attr.
+  using AttrSet = unsigned;
+
 public:
   FuncOrProtoDecl(
       const std::string &name,
       std::vector<std::pair<std::string, std::string>> &&args,
-      const std::string &type)
+      const std::string &type,
+      AttrSet attrs)
     : name_(name)
     , args_(std::move(args))
     , type_(type)
+    , attrs_(attrs)
   {
   }
 
   virtual ~FuncOrProtoDecl();
 
   const std::string &GetName() const { return name_; }
+  const std::string &GetType() const { return type_; }
+
+  /// Check whether an attribute is present.
+  bool HasAttr(Attr attr) const { return attrs_ & GetAttrMask(attr); }
+  /// Returns the set of attributes.
+  AttrSet GetAttrs() const { return attrs_; }
+
+  /// Return the bit representing an attribute in an AttrSet.
+  static AttrSet GetAttrMask(Attr attr)
+  {
+    return 1u << static_cast<unsigned>(attr);
+  }
 
   size_t arg_size() const { return args_.size(); }
   ArgList::const_iterator arg_begin() const { return args_.begin(); }
@@ -322,13 +431,15 @@ private:
   /// Argument list.
   ArgList args_;
   /// Return type identifier.
-  const std::string &type_;
+  const std::string type_;
+  /// Attributes of the declaration.
+  AttrSet attrs_;
 };
 
 /**
  * External function prototype declaration.
  *
- * func proto(a: int): int = "proto"
+ * @pure func proto(a: int): int = "proto"
  */
 class ProtoDecl final : public FuncOrProtoDecl {
 public:
@@ -336,8 +447,9 @@ public:
       const std::string &name,
       std::vector<std::pair<std::string, std::string>> &&args,
       const std::string &type,
-      const std::string &primitive)
-    : FuncOrProtoDecl(name, std::move(args), type)
+      const std::string &primitive,
+      AttrSet attrs = 0)
+    : FuncOrProtoDecl(name, std::move(args), type, attrs)
     , primitive_(primitive)
   {
   }
@@ -359,18 +471,48 @@ public:
       const std::string &name,
       std::vector<std::pair<std::string, std::string>> &&args,
       const std::string &type,
-      std::shared_ptr<BlockStmt> body)
-    : FuncOrProtoDecl(name, std::move(args), type)
+      std::shared_ptr<BlockStmt> body,
+      AttrSet attrs = 0)
+    : FuncOrProtoDecl(name, std::move(args), type, attrs)
     , body_(body)
   {
   }
 
-  const BlockStmt &GetBody() const { return *body_; }
+  /// Check whether the body was parsed. Bodies are parsed on demand
+  /// when the parser runs in lazy mode.
+  bool HasBody() const { return body_ != nullptr; }
+  const BlockStmt &GetBody() const
+  {
+    assert(body_ && "function body not parsed");
+    return *body_;
+  }
+  void SetBody(std::shared_ptr<BlockStmt> body) { body_ = body; }
 
 private:
   std::shared_ptr<BlockStmt> body_;
 };
 
+/**
+ * Function expression, creating a closure.
+ *
+ * func(a: int): int { ... }
+ */
+class FuncExpr final : public Expr {
+public:
+  FuncExpr(std::shared_ptr<FuncDecl> decl)
+    : Expr(Kind::FUNC)
+    , decl_(decl)
+  {
+  }
+
+  /// Returns the declaration holding the arguments and the body.
+  const FuncDecl &GetDecl() const { return *decl_; }
+
+private:
+  /// Anonymous function, named after its location.
+  std::shared_ptr<FuncDecl> decl_;
+};
+
 /// Alternative for a toplevel construct.
 using TopLevelStmt = std::variant
     < std::shared_ptr<FuncDecl>
@@ -0,0 +1,478 @@
+// This file is part of the IMP project.
+
+#include <algorithm>
+
+#include "batch.h"
+#include "program.h"
+
+
+
+// -----------------------------------------------------------------------------
+std::vector<BatchInterp::Result> BatchInterp::Run(const std::vector<std::string> &records)
+{
+  std::vector<Result> results;
+  for (size_t base = 0; base < records.size(); base += width_) {
+    // All lanes start together at the beginning of the program.
+    auto n = std::min<size_t>(width_, records.size() - base);
+    lanes_.clear();
+    stack_.clear();
+    auto &start = waiting_[{ 0, 0 }];
+    for (size_t i = 0; i < n; ++i) {
+      lanes_.push_back(std::make_unique<Lane>(prog_, records[base + i]));
+      start.push_back(i);
+    }
+    RunLanes();
+
+    for (auto &lane : lanes_) {
+      results.push_back({ lane->Out.str(), lane->Error });
+    }
+  }
+  return results;
+}
+
+// -----------------------------------------------------------------------------
+void BatchInterp::RunLanes()
+{
+  Group group{ 0, 0, {} };
+  for (;;) {
+    if (group.Lanes.empty()) {
+      if (waiting_.empty()) {
+        return;
+      }
+      auto it = waiting_.begin();
+      group.Sp = it->first.first;
+      group.Pc = it->first.second;
+      group.Lanes = std::move(it->second);
+      waiting_.erase(it);
+    } else if (!waiting_.empty() && !Order()({ group.Sp, group.Pc }, waiting_.begin()->first)) {
+      // Another group must run first or reached the same point: lanes
+      // behind are allowed to catch up, merging with the waiting ones.
+      for (auto lane : group.Lanes) {
+        Defer(group.Sp, group.Pc, lane);
+      }
+      group.Lanes.clear();
+      continue;
+    }
+    Step(group);
+  }
+}
+
+// -----------------------------------------------------------------------------
+void BatchInterp::Step(Group &group)
+{
+  auto &lanes = group.Lanes;
+  auto sp = group.Sp;
+
+  // Lanes going to the same place as the first one stay in the group.
+  auto &kept = kept_;
+  kept.clear();
+  std::optional<Key> next;
+  auto route = [&] (unsigned lane, unsigned toSp, size_t toPc) {
+    Key key{ toSp, toPc };
+    if (!next) {
+      next = key;
+    }
+    if (*next == key) {
+      kept.push_back(lane);
+    } else {
+      Defer(toSp, toPc, lane);
+    }
+  };
+  auto commit = [&] {
+    lanes.swap(kept);
+    if (next) {
+      group.Sp = next->first;
+      group.Pc = next->second;
+    }
+  };
+
+  auto op = prog_.Read<Opcode>(group.Pc);
+  switch (op) {
+    case Opcode::PUSH_FUNC: {
+      Value fn(prog_.Read<size_t>(group.Pc));
+      fn.Arity = prog_.Read<unsigned>(group.Pc);
+      Reserve(sp + 1);
+      for (auto lane : lanes) {
+        stack_[sp][lane] = fn;
+      }
+      group.Sp += 1;
+      return;
+    }
+    case Opcode::PUSH_PROTO: {
+      Value fn(prog_.Read<RuntimeFn>(group.Pc));
+      fn.Arity = prog_.Read<unsigned>(group.Pc);
+      Reserve(sp + 1);
+      for (auto lane : lanes) {
+        stack_[sp][lane] = fn;
+      }
+      group.Sp += 1;
+      return;
+    }
+    case Opcode::PUSH_INT:
+    case Opcode::PUSH_INT_0:
+    case Opcode::PUSH_INT_1: {
+      auto val = prog_.Read<int64_t>(group.Pc);
+      Reserve(sp + 1);
+      for (auto lane : lanes) {
+        stack_[sp][lane] = Value(val);
+      }
+      group.Sp += 1;
+      return;
+    }
+    case Opcode::MAKE_CLOSURE: {
+      auto n = prog_.Read<unsigned>(group.Pc);
+      for (auto lane : lanes) {
+        auto &fn = stack_[sp - 1][lane];
+        auto &env = closures_.emplace_back();
+        env.Addr = fn.Val.Addr;
+        for (unsigned i = 0; i < n; ++i) {
+          env.Captures.push_back(stack_[sp - 1 - n + i][lane]);
+        }
+        Value closure(&env);
+        closure.Arity = fn.Arity - n;
+        stack_[sp - 1 - n][lane] = closure;
+      }
+      group.Sp -= n;
+      return;
+    }
+    case Opcode::PEEK:
+    case Opcode::PEEK_0:
+    case Opcode::PEEK_1:
+    case Opcode::PEEK_2:
+    case Opcode::PEEK_3:
+    case Opcode::DUP:
+    case Opcode::OVER: {
+      unsigned idx;
+      if (op == Opcode::DUP || op == Opcode::OVER) {
+        idx = op == Opcode::OVER;
+      } else {
+        idx = prog_.Read<unsigned>(group.Pc);
+      }
+      Reserve(sp + 1);
+      auto &src = stack_[sp - 1 - idx];
+      auto &dst = stack_[sp];
+      for (auto lane : lanes) {
+        dst[lane] = src[lane];
+      }
+      group.Sp += 1;
+      return;
+    }
+    case Opcode::SWAP: {
+      for (auto lane : lanes) {
+        std::swap(stack_[sp - 1][lane], stack_[sp - 2][lane]);
+      }
+      return;
+    }
+    case Opcode::ROT: {
+      // Brings the third value to the top: a b c -> b c a.
+      for (auto lane : lanes) {
+        auto a = stack_[sp - 3][lane];
+        stack_[sp - 3][lane] = stack_[sp - 2][lane];
+        stack_[sp - 2][lane] = stack_[sp - 1][lane];
+        stack_[sp - 1][lane] = a;
+      }
+      return;
+    }
+    case Opcode::STORE: {
+      auto idx = prog_.Read<unsigned>(group.Pc);
+      auto &src = stack_[sp - 1];
+      auto &dst = stack_[sp - 2 - idx];
+      for (auto lane : lanes) {
+        dst[lane] = src[lane];
+      }
+      group.Sp -= 1;
+      return;
+    }
+    case Opcode::POP: {
+      group.Sp -= 1;
+      return;
+    }
+    case Opcode::POPN: {
+      group.Sp -= prog_.Read<unsigned>(group.Pc);
+      return;
+    }
+    case Opcode::CALL:
+    case Opcode::CALL_FUNC:
+    case Opcode::CALL_PROTO:
+    case Opcode::CALL_CLOSURE: {
+      // The return address replaces the callee on the stack.
+      auto nargs = prog_.Read<unsigned>(group.Pc);
+      for (auto lane : lanes) {
+        auto callee = stack_[sp - 1][lane];
+        if (callee.Kind != Value::Kind::INT &&
+            callee.Kind != Value::Kind::GENERATOR &&
+            callee.Arity != nargs)
+        {
+          Fail(lane, "wrong number of arguments: expected " +
+              std::to_string(callee.Arity) + ", got " + std::to_string(nargs));
+          continue;
+        }
+        switch (callee.Kind) {
+          case Value::Kind::PROTO: {
+            if (CallProto(group, lane, callee.Val.Proto, nargs)) {
+              route(lane, sp - nargs, group.Pc);
+            }
+            continue;
+          }
+          case Value::Kind::ADDR: {
+            stack_[sp - 1][lane] = Value(group.Pc);
+            route(lane, sp, callee.Val.Addr);
+            continue;
+          }
+          case Value::Kind::CLOSURE: {
+            // The captures are inserted below the arguments.
+            auto &env = *callee.Val.Env;
+            unsigned n = env.Captures.size();
+            Reserve(sp + n);
+            auto base = sp - 1 - nargs;
+            for (unsigned i = nargs; i-- > 0; ) {
+              stack_[base + n + i][lane] = stack_[base + i][lane];
+            }
+            for (unsigned i = 0; i < n; ++i) {
+              stack_[base + i][lane] = env.Captures[i];
+            }
+            stack_[sp - 1 + n][lane] = Value(group.Pc);
+            route(lane, sp + n, env.Addr);
+            continue;
+          }
+          case Value::Kind::GENERATOR: {
+            Fail(lane, "cannot call generator");
+            continue;
+          }
+          case Value::Kind::INT: {
+            Fail(lane, "cannot call integer");
+            continue;
+          }
+        }
+      }
+      commit();
+      return;
+    }
+    case Opcode::GEN_CREATE:
+    case Opcode::GEN_YIELD:
+    case Opcode::GEN_RETURN: {
+      for (auto lane : lanes) {
+        Fail(lane, "generators are not supported in batch mode");
+      }
+      lanes.clear();
+      return;
+    }
+    case Opcode::ADD: {
+      Binary(group, [] (int64_t lhs, int64_t rhs, int64_t &res) {
+        return __builtin_add_overflow(lhs, rhs, &res) ? "overflow error" : nullptr;
+      });
+      return;
+    }
+    case Opcode::SUB: {
+      Binary(group, [] (int64_t lhs, int64_t rhs, int64_t &res) {
+        return __builtin_sub_overflow(lhs, rhs, &res) ? "overflow error" : nullptr;
+      });
+      return;
+    }
+    case Opcode::ADD_NOCHECK: {
+      Binary(group, [] (int64_t lhs, int64_t rhs, int64_t &res) {
+        res = static_cast<int64_t>(static_cast<uint64_t>(lhs) + rhs);
+        return nullptr;
+      });
+      return;
+    }
+    case Opcode::SUB_NOCHECK: {
+      Binary(group, [] (int64_t lhs, int64_t rhs, int64_t &res) {
+        res = static_cast<int64_t>(static_cast<uint64_t>(lhs) - rhs);
+        return nullptr;
+      });
+      return;
+    }
+    case Opcode::MUL: {
+      Binary(group, [] (int64_t lhs, int64_t rhs, int64_t &res) {
+        res = static_cast<int64_t>(static_cast<uint64_t>(lhs) * rhs);
+        return nullptr;
+      });
+      return;
+    }
+    case Opcode::DIV: {
+      Binary(group, [] (int64_t lhs, int64_t rhs, int64_t &res) {
+        if (rhs == 0) {
+          return "division by 0";
+        }
+        res = lhs / rhs;
+        return static_cast<const char *>(nullptr);
+      });
+      return;
+    }
+    case Opcode::MOD: {
+      Binary(group, [] (int64_t lhs, int64_t rhs, int64_t &res) {
+        if (rhs == 0) {
+          return "division by 0";
+        }
+        res = lhs % rhs;
+        return static_cast<const char *>(nullptr);
+      });
+      return;
+    }
+    case Opcode::DIV_CONST:
+    case Opcode::MOD_CONST: {
+      DivMagic magic;
+      magic.Divisor = prog_.Read<int64_t>(group.Pc);
+      magic.Multiplier = prog_.Read<int64_t>(group.Pc);
+      magic.Shift = prog_.Read<uint32_t>(group.Pc);
+      auto &top = stack_[sp - 1];
+      for (auto lane : lanes) {
+        auto lhs = top[lane].Val.Int;
+        if (op == Opcode::DIV_CONST) {
+          top[lane] = Value(magic.Divide(lhs));
+        } else {
+          top[lane] = Value(magic.Remainder(lhs));
+        }
+      }
+      return;
+    }
+    case Opcode::GREATER: {
+      Binary(group, [] (int64_t lhs, int64_t rhs, int64_t &res) {
+        res = lhs > rhs;
+        return nullptr;
+      });
+      return;
+    }
+    case Opcode::LOWER: {
+      Binary(group, [] (int64_t lhs, int64_t rhs, int64_t &res) {
+        res = lhs < rhs;
+        return nullptr;
+      });
+      return;
+    }
+    case Opcode::GREATER_EQ: {
+      Binary(group, [] (int64_t lhs, int64_t rhs, int64_t &res) {
+        res = lhs >= rhs;
+        return nullptr;
+      });
+      return;
+    }
+    case Opcode::LOWER_EQ: {
+      Binary(group, [] (int64_t lhs, int64_t rhs, int64_t &res) {
+        res = lhs <= rhs;
+        return nullptr;
+      });
+      return;
+    }
+    case Opcode::IS_EQ: {
+      Binary(group, [] (int64_t lhs, int64_t rhs, int64_t &res) {
+        res = lhs == rhs;
+        return nullptr;
+      });
+      return;
+    }
+    case Opcode::RET: {
+      auto depth = prog_.Read<unsigned>(group.Pc);
+      auto nargs = prog_.Read<unsigned>(group.Pc);
+      auto base = sp - 2 - depth - nargs;
+      for (auto lane : lanes) {
+        auto ret = stack_[sp - 2 - depth][lane].Val.Addr;
+        stack_[base][lane] = stack_[sp - 1][lane];
+        route(lane, base + 1, ret);
+      }
+      commit();
+      return;
+    }
+    case Opcode::JUMP_FALSE:
+    case Opcode::JUMP_FALSE_INT: {
+      auto addr = prog_.Read<size_t>(group.Pc);
+      for (auto lane : lanes) {
+        route(lane, sp - 1, stack_[sp - 1][lane] ? group.Pc : addr);
+      }
+      commit();
+      return;
+    }
+    case Opcode::JUMP: {
+      group.Pc = prog_.Read<size_t>(group.Pc);
+      return;
+    }
+    case Opcode::LAZY: {
+      // Compile the function and turn the stub into a jump to its code.
+      auto at = group.Pc - 1;
+      auto id = prog_.Read<size_t>(group.Pc);
+      if (!compiler_) {
+        throw RuntimeError("no compiler for lazy function");
+      }
+      group.Pc = compiler_(id);
+      prog_.Patch(at, Opcode::JUMP);
+      prog_.Write<size_t>(at + 1, group.Pc);
+      return;
+    }
+    case Opcode::STOP: {
+      lanes.clear();
+      return;
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+void BatchInterp::Defer(unsigned sp, size_t pc, unsigned lane)
+{
+  waiting_[{ sp, pc }].push_back(lane);
+}
+
+// -----------------------------------------------------------------------------
+void BatchInterp::Fail(unsigned lane, const std::string &msg)
+{
+  lanes_[lane]->Error = msg;
+}
+
+// -----------------------------------------------------------------------------
+void BatchInterp::Prune(Group &group)
+{
+  auto &lanes = group.Lanes;
+  lanes.erase(std::remove_if(lanes.begin(), lanes.end(), [this] (unsigned lane) {
+    return lanes_[lane]->Error.has_value();
+  }), lanes.end());
+}
+
+// -----------------------------------------------------------------------------
+void BatchInterp::Reserve(unsigned sp)
+{
+  while (stack_.size() < sp) {
+    stack_.emplace_back(lanes_.size());
+  }
+}
+
+// -----------------------------------------------------------------------------
+bool BatchInterp::CallProto(Group &group, unsigned lane, RuntimeFn fn, unsigned nargs)
+{
+  // The arguments are passed on the stack of the scalar interpreter of the
+  // lane, in the same order, and the result replaces them.
+  auto &scalar = lanes_[lane]->Scalar;
+  auto sp = group.Sp;
+  for (unsigned i = 0; i < nargs; ++i) {
+    scalar.Push(stack_[sp - 1 - nargs + i][lane]);
+  }
+  try {
+    (*fn) (scalar);
+  } catch (const RuntimeError &ex) {
+    Fail(lane, ex.what());
+    return false;
+  }
+  stack_[sp - 1 - nargs][lane] = scalar.Pop();
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+template <typename F>
+void BatchInterp::Binary(Group &group, F f)
+{
+  auto &lhs = stack_[group.Sp - 2];
+  auto &rhs = stack_[group.Sp - 1];
+  bool failed = false;
+  for (auto lane : group.Lanes) {
+    int64_t res;
+    if (const char *err = f(lhs[lane].Val.Int, rhs[lane].Val.Int, res)) {
+      Fail(lane, err);
+      failed = true;
+      continue;
+    }
+    lhs[lane] = Value(res);
+  }
+  group.Sp -= 1;
+  if (failed) {
+    Prune(group);
+  }
+}
@@ -0,0 +1,139 @@
+// This file is part of the IMP project.
+
+#pragma once
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "interp.h"
+
+class Program;
+
+
+
+/**
+ * Interpreter running a program over many independent records at once.
+ *
+ * Each record is executed by a lane, with its own input and output. The
+ * stack is stored by columns: a slot holds the values of all lanes, so an
+ * instruction is decoded once and applied to all the lanes executing it.
+ *
+ * Lanes at the same address and stack depth form a group which advances in
+ * lockstep. Branches, calls and returns taking different targets split a
+ * group, and the deepest group with the lowest address is executed first,
+ * so the lanes of a split group reconverge once they reach the same point,
+ * such as the end of a conditional or of a loop.
+ *
+ * Runtime errors stop the lane which raised them. Generators are not
+ * supported, as their stacks cannot be laid out by columns.
+ */
+class BatchInterp {
+public:
+  /// Outcome of the execution of a record.
+  struct Result {
+    /// Output written by the program.
+    std::string Output;
+    /// Message of the runtime error which stopped the program, if any.
+    std::optional<std::string> Error;
+  };
+
+public:
+  /// Creates an interpreter running up to a given number of records at once.
+  BatchInterp(Program &prog, unsigned width)
+    : prog_(prog)
+    , width_(width)
+  {
+  }
+
+  /// Sets the callback invoked by the stubs of lazily-compiled functions.
+  void SetLazyCompiler(Interp::LazyCompiler compiler) { compiler_ = compiler; }
+
+  /// Runs the program once for each record, which is the input of its run.
+  std::vector<Result> Run(const std::vector<std::string> &records);
+
+private:
+  using Value = Interp::Value;
+
+  /// State of a record being executed.
+  struct Lane {
+    Lane(Program &prog, const std::string &record)
+      : In(record)
+      , Scalar(prog, In, Out)
+    {
+    }
+
+    /// Input of the record.
+    std::istringstream In;
+    /// Output of the record.
+    std::ostringstream Out;
+    /// Interpreter whose stack passes arguments to runtime methods.
+    Interp Scalar;
+    /// Error which stopped the lane.
+    std::optional<std::string> Error;
+  };
+
+  /// Lanes executing in lockstep.
+  struct Group {
+    /// Address of the next instruction.
+    size_t Pc;
+    /// Depth of the stack.
+    unsigned Sp;
+    /// Indices of the lanes.
+    std::vector<unsigned> Lanes;
+  };
+
+  /// Stack depth and address identifying a group.
+  using Key = std::pair<unsigned, size_t>;
+
+  /// Orders groups by decreasing depth, then by increasing address.
+  struct Order {
+    bool operator() (const Key &a, const Key &b) const
+    {
+      return a.first != b.first ? a.first > b.first : a.second < b.second;
+    }
+  };
+
+private:
+  /// Runs lanes until all of them stop.
+  void RunLanes();
+  /// Executes the next instruction of a group.
+  void Step(Group &group);
+
+  /// Moves a lane to the group waiting at a given depth and address.
+  void Defer(unsigned sp, size_t pc, unsigned lane);
+  /// Stops a lane, recording an error.
+  void Fail(unsigned lane, const std::string &msg);
+  /// Removes the lanes which failed from a group.
+  void Prune(Group &group);
+  /// Ensures the stack has at least a given number of slots.
+  void Reserve(unsigned sp);
+
+  /// Calls a runtime method on the arguments of a lane, false if it failed.
+  bool CallProto(Group &group, unsigned lane, RuntimeFn fn, unsigned nargs);
+  /// Applies an integer operation to the two values on top of the stack.
+  template <typename F>
+  void Binary(Group &group, F f);
+
+private:
+  /// Reference to the program being executed.
+  Program &prog_;
+  /// Maximum number of lanes.
+  unsigned width_;
+  /// Lanes of the records being executed.
+  std::vector<std::unique_ptr<Lane>> lanes_;
+  /// Columns of the stack, holding one value for each lane.
+  std::vector<std::vector<Value>> stack_;
+  /// Lanes staying in the group after a branch, reused across steps.
+  std::vector<unsigned> kept_;
+  /// Groups of lanes waiting to be executed.
+  std::map<Key, std::vector<unsigned>, Order> waiting_;
+  /// Environments of the closures created by the program.
+  std::deque<Interp::Closure> closures_;
+  /// Callback compiling functions on demand.
+  Interp::LazyCompiler compiler_;
+};
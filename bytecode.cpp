@@ -0,0 +1,539 @@
+// This file is part of the IMP project.
+
+#include <algorithm>
+#include <optional>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+#include "bytecode.h"
+#include "runtime.h"
+
+
+
+// -----------------------------------------------------------------------------
+static std::string FormatMessage(size_t pc, const std::string &msg)
+{
+  std::ostringstream os;
+  os << "[bytecode:" << pc << "] " << msg;
+  return os.str();
+}
+
+// -----------------------------------------------------------------------------
+BytecodeError::BytecodeError(size_t pc, const std::string &msg)
+  : std::runtime_error(FormatMessage(pc, msg))
+{
+}
+
+// -----------------------------------------------------------------------------
+static std::optional<size_t> GetOperandSize(uint8_t op)
+{
+  switch (static_cast<Opcode>(op)) {
+    case Opcode::PUSH_FUNC: return sizeof(size_t) + sizeof(unsigned);
+    case Opcode::PUSH_PROTO: return sizeof(RuntimeFn) + sizeof(unsigned);
+    case Opcode::PUSH_INT:
+    case Opcode::PUSH_INT_0:
+    case Opcode::PUSH_INT_1: return sizeof(int64_t);
+    case Opcode::MAKE_CLOSURE: return sizeof(unsigned);
+    case Opcode::PEEK:
+    case Opcode::PEEK_0:
+    case Opcode::PEEK_1:
+    case Opcode::PEEK_2:
+    case Opcode::PEEK_3: return sizeof(unsigned);
+    case Opcode::DUP:
+    case Opcode::OVER:
+    case Opcode::SWAP:
+    case Opcode::ROT: return 0;
+    case Opcode::STORE: return sizeof(unsigned);
+    case Opcode::POP: return 0;
+    case Opcode::POPN: return sizeof(unsigned);
+    case Opcode::CALL:
+    case Opcode::CALL_FUNC:
+    case Opcode::CALL_PROTO:
+    case Opcode::CALL_CLOSURE: return sizeof(unsigned);
+    case Opcode::GEN_CREATE: return sizeof(unsigned);
+    case Opcode::GEN_YIELD:
+    case Opcode::GEN_RETURN: return 0;
+    case Opcode::ADD:
+    case Opcode::SUB:
+    case Opcode::ADD_NOCHECK:
+    case Opcode::SUB_NOCHECK:
+    case Opcode::MUL:
+    case Opcode::DIV:
+    case Opcode::MOD:
+    case Opcode::GREATER:
+    case Opcode::LOWER:
+    case Opcode::GREATER_EQ:
+    case Opcode::LOWER_EQ:
+    case Opcode::IS_EQ: return 0;
+    case Opcode::DIV_CONST:
+    case Opcode::MOD_CONST: return 2 * sizeof(int64_t) + sizeof(uint32_t);
+    case Opcode::RET: return 2 * sizeof(unsigned);
+    case Opcode::JUMP_FALSE:
+    case Opcode::JUMP_FALSE_INT: return sizeof(size_t);
+    case Opcode::JUMP: return sizeof(size_t);
+    case Opcode::LAZY: return sizeof(size_t);
+    case Opcode::STOP: return 0;
+  }
+  return std::nullopt;
+}
+
+// -----------------------------------------------------------------------------
+static bool IsCall(Opcode op)
+{
+  switch (op) {
+    case Opcode::CALL:
+    case Opcode::CALL_FUNC:
+    case Opcode::CALL_PROTO:
+    case Opcode::CALL_CLOSURE: return true;
+    default: return false;
+  }
+}
+
+// -----------------------------------------------------------------------------
+void BytecodeVerifier::Verify(const Program &prog)
+{
+  insts_.clear();
+  funcs_.clear();
+  decoded_ = 0;
+
+  auto funcs = Decode(prog);
+
+  VerifyFrame(prog, 0, false);
+  for (size_t func : funcs) {
+    VerifyFrame(prog, func, true);
+  }
+}
+
+// -----------------------------------------------------------------------------
+void BytecodeVerifier::Verify(const Program &prog, size_t entry, unsigned nargs)
+{
+  // The code checked before is unchanged, so only the new code is decoded.
+  // Besides the function, it holds the closures created by the function.
+  auto funcs = Decode(prog);
+  if (!funcs_.emplace(entry, nargs).second && funcs_[entry] != nargs) {
+    throw BytecodeError(entry, "inconsistent function arity");
+  }
+
+  VerifyFrame(prog, entry, true);
+  for (size_t func : funcs) {
+    if (func != entry) {
+      VerifyFrame(prog, func, true);
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+std::vector<size_t> BytecodeVerifier::Decode(const Program &prog)
+{
+  if (prog.GetSize() == 0) {
+    throw BytecodeError(0, "empty program");
+  }
+
+  // Find the boundaries of all instructions, checking that each of them
+  // is fully contained in the stream and that operands are well-formed.
+  // Addresses increase, so they are inserted at the end of the set.
+  std::vector<std::pair<size_t, size_t>> targets;
+  std::vector<size_t> funcs;
+  std::set<size_t> closures;
+  std::optional<unsigned> pushed;
+  for (size_t pc = decoded_, end = prog.GetSize(); pc < end; ) {
+    size_t start = pc;
+    insts_.insert(insts_.end(), start);
+
+    // Arity of the function pushed by the previous instruction, if any.
+    auto prevArity = std::exchange(pushed, std::nullopt);
+
+    auto raw = prog.Read<uint8_t>(pc);
+    auto size = GetOperandSize(raw);
+    if (!size) {
+      throw BytecodeError(start, "invalid opcode " + std::to_string(raw));
+    }
+    if (pc + *size > end) {
+      throw BytecodeError(start, "truncated instruction");
+    }
+
+    switch (static_cast<Opcode>(raw)) {
+      case Opcode::PUSH_FUNC: {
+        auto addr = prog.Read<size_t>(pc);
+        pushed = prog.Read<unsigned>(pc);
+        if (funcs_.emplace(addr, *pushed).second) {
+          funcs.push_back(addr);
+        } else if (funcs_[addr] != *pushed) {
+          throw BytecodeError(start, "inconsistent function arity");
+        }
+        targets.emplace_back(start, addr);
+        continue;
+      }
+      case Opcode::MAKE_CLOSURE: {
+        // Closures are made from the function pushed right before, whose
+        // last arguments are the captures.
+        auto n = prog.Read<unsigned>(pc);
+        if (!prevArity) {
+          throw BytecodeError(start, "closure of a non-function");
+        }
+        if (n > *prevArity) {
+          throw BytecodeError(start, "closure captures too many values");
+        }
+        closures.insert(start);
+        continue;
+      }
+      case Opcode::PUSH_PROTO: {
+        auto fn = prog.Read<RuntimeFn>(pc);
+        auto arity = prog.Read<unsigned>(pc);
+        auto it = std::find_if(
+            kRuntimeFns.begin(),
+            kRuntimeFns.end(),
+            [fn] (auto &entry) { return entry.second.Fn == fn; }
+        );
+        if (it == kRuntimeFns.end()) {
+          throw BytecodeError(start, "unknown runtime function");
+        }
+        if (it->second.NumArgs != arity) {
+          throw BytecodeError(start, "inconsistent prototype arity");
+        }
+        continue;
+      }
+      case Opcode::PUSH_INT_0:
+      case Opcode::PUSH_INT_1: {
+        // Quickened forms keep their original operand.
+        auto val = prog.Read<int64_t>(pc);
+        if (val != (static_cast<Opcode>(raw) == Opcode::PUSH_INT_1)) {
+          throw BytecodeError(start, "inconsistent integer constant");
+        }
+        continue;
+      }
+      case Opcode::DIV_CONST:
+      case Opcode::MOD_CONST: {
+        // The constants must be those computed for the divisor.
+        auto d = prog.Read<int64_t>(pc);
+        auto mul = prog.Read<int64_t>(pc);
+        auto shift = prog.Read<uint32_t>(pc);
+        if (!DivMagic::IsValid(d)) {
+          throw BytecodeError(start, "invalid constant divisor");
+        }
+        auto magic = DivMagic::For(d);
+        if (mul != magic.Multiplier || shift != magic.Shift) {
+          throw BytecodeError(start, "inconsistent division constants");
+        }
+        continue;
+      }
+      case Opcode::JUMP_FALSE:
+      case Opcode::JUMP_FALSE_INT:
+      case Opcode::JUMP: {
+        targets.emplace_back(start, prog.Read<size_t>(pc));
+        continue;
+      }
+      default: {
+        pc += *size;
+        continue;
+      }
+    }
+  }
+
+  // All jumps and function addresses must land on an instruction. The end
+  // of the stream is a valid target for jumps in unreachable code: if such a
+  // jump is reachable, the frame verifier reports it.
+  insts_.insert(prog.GetSize());
+  for (auto &[pc, target] : targets) {
+    CheckTarget(pc, target);
+    if (closures.count(target)) {
+      throw BytecodeError(pc, "jump separates a closure from its function");
+    }
+  }
+  decoded_ = prog.GetSize();
+  return funcs;
+}
+
+// -----------------------------------------------------------------------------
+void BytecodeVerifier::VerifyFrame(const Program &prog, size_t entry, bool isFunc)
+{
+  // Functions with an empty body start at the end of the program.
+  if (entry >= prog.GetSize()) {
+    throw BytecodeError(entry, "control flow falls off the end");
+  }
+
+  // Depth of the stack at the start of each visited instruction, relative
+  // to the base of the frame. Arguments and the return address are below
+  // the base and are not counted.
+  std::map<size_t, unsigned> depths;
+  std::vector<std::pair<size_t, unsigned>> queue{ { entry, 0 } };
+
+  // Number of arguments, as indicated by the return instructions.
+  std::optional<unsigned> nargs;
+  // Highest argument index referenced by a PEEK instruction.
+  std::optional<size_t> maxArg;
+
+  // Generators create their coroutine on entry. The stubs of lazily-compiled
+  // functions jump to their bodies.
+  size_t body = entry;
+  bool isGen = false;
+  for (std::set<size_t> seen; body < prog.GetSize() && seen.insert(body).second; ) {
+    size_t pc = body;
+    auto op = prog.Read<Opcode>(pc);
+    if (op != Opcode::JUMP) {
+      isGen = isFunc && op == Opcode::GEN_CREATE;
+      break;
+    }
+    body = prog.Read<size_t>(pc);
+  }
+
+  auto flow = [&] (size_t from, size_t to, unsigned depth) {
+    if (to >= prog.GetSize()) {
+      throw BytecodeError(from, "control flow falls off the end");
+    }
+    queue.emplace_back(to, depth);
+  };
+
+  while (!queue.empty()) {
+    auto [start, depth] = queue.back();
+    queue.pop_back();
+
+    // Check for consistency at merge points.
+    if (auto it = depths.find(start); it != depths.end()) {
+      if (it->second != depth) {
+        std::ostringstream os;
+        os << "inconsistent stack depth at merge point: ";
+        os << it->second << " vs " << depth;
+        throw BytecodeError(start, os.str());
+      }
+      continue;
+    }
+    depths.emplace(start, depth);
+
+    auto need = [&, start = start, depth = depth] (unsigned n) {
+      if (depth < n) {
+        throw BytecodeError(start, "stack underflow");
+      }
+    };
+
+    size_t pc = start;
+    auto op = prog.Read<Opcode>(pc);
+    switch (op) {
+      case Opcode::PUSH_FUNC:
+      case Opcode::PUSH_PROTO: {
+        // Calls right after the callee is pushed are checked here, the
+        // others by the interpreter, against the arity of the callee.
+        pc += op == Opcode::PUSH_FUNC ? sizeof(size_t) : sizeof(RuntimeFn);
+        auto arity = prog.Read<unsigned>(pc);
+        if (size_t next = pc; next < prog.GetSize()) {
+          if (IsCall(prog.Read<Opcode>(next))) {
+            auto n = prog.Read<unsigned>(next);
+            if (n != arity) {
+              std::ostringstream os;
+              os << "call with " << n << " arguments to a function ";
+              os << "taking " << arity;
+              throw BytecodeError(pc, os.str());
+            }
+          }
+        }
+        flow(start, pc, depth + 1);
+        continue;
+      }
+      case Opcode::PUSH_INT:
+      case Opcode::PUSH_INT_0:
+      case Opcode::PUSH_INT_1: {
+        pc += *GetOperandSize(static_cast<uint8_t>(op));
+        flow(start, pc, depth + 1);
+        continue;
+      }
+      case Opcode::MAKE_CLOSURE: {
+        // Pops the captured values and the address of the function.
+        auto n = prog.Read<unsigned>(pc);
+        need(n + 1);
+        flow(start, pc, depth - n);
+        continue;
+      }
+      case Opcode::PEEK:
+      case Opcode::PEEK_0:
+      case Opcode::PEEK_1:
+      case Opcode::PEEK_2:
+      case Opcode::PEEK_3:
+      case Opcode::DUP:
+      case Opcode::OVER: {
+        unsigned idx;
+        if (op == Opcode::DUP || op == Opcode::OVER) {
+          idx = op == Opcode::OVER;
+        } else {
+          idx = prog.Read<unsigned>(pc);
+          auto implicit = static_cast<unsigned>(op) - static_cast<unsigned>(Opcode::PEEK_0);
+          if (op != Opcode::PEEK && idx != implicit) {
+            throw BytecodeError(start, "inconsistent peek index");
+          }
+        }
+        if (idx >= depth) {
+          if (!isFunc) {
+            throw BytecodeError(start, "peek out of frame");
+          }
+          if (idx == depth) {
+            throw BytecodeError(start, "peek at return address");
+          }
+          size_t arg = idx - depth - 1;
+          maxArg = std::max(maxArg.value_or(0), arg);
+        }
+        flow(start, pc, depth + 1);
+        continue;
+      }
+      case Opcode::SWAP: {
+        need(2);
+        flow(start, pc, depth);
+        continue;
+      }
+      case Opcode::ROT: {
+        need(3);
+        flow(start, pc, depth);
+        continue;
+      }
+      case Opcode::STORE: {
+        auto idx = prog.Read<unsigned>(pc);
+        need(1);
+        if (idx >= depth - 1) {
+          if (!isFunc) {
+            throw BytecodeError(start, "store out of frame");
+          }
+          if (idx == depth - 1) {
+            throw BytecodeError(start, "store to return address");
+          }
+          size_t arg = idx - depth;
+          maxArg = std::max(maxArg.value_or(0), arg);
+        }
+        flow(start, pc, depth - 1);
+        continue;
+      }
+      case Opcode::POP: {
+        need(1);
+        flow(start, pc, depth - 1);
+        continue;
+      }
+      case Opcode::DIV_CONST:
+      case Opcode::MOD_CONST: {
+        pc += *GetOperandSize(static_cast<uint8_t>(op));
+        need(1);
+        flow(start, pc, depth);
+        continue;
+      }
+      case Opcode::POPN: {
+        auto n = prog.Read<unsigned>(pc);
+        need(n);
+        flow(start, pc, depth - n);
+        continue;
+      }
+      case Opcode::CALL:
+      case Opcode::CALL_FUNC:
+      case Opcode::CALL_PROTO:
+      case Opcode::CALL_CLOSURE: {
+        auto n = prog.Read<unsigned>(pc);
+        need(n + 1);
+        flow(start, pc, depth - n);
+        continue;
+      }
+      case Opcode::GEN_CREATE: {
+        // The frame continues on the stack of the generator.
+        auto n = prog.Read<unsigned>(pc);
+        if (!isGen || start != body) {
+          throw BytecodeError(start, "generator created outside of function entry");
+        }
+        nargs = n;
+        flow(start, pc, depth);
+        continue;
+      }
+      case Opcode::GEN_YIELD: {
+        if (!isGen) {
+          throw BytecodeError(start, "yield outside of a generator");
+        }
+        need(1);
+        flow(start, pc, depth - 1);
+        continue;
+      }
+      case Opcode::GEN_RETURN: {
+        if (!isGen) {
+          throw BytecodeError(start, "generator return outside of a generator");
+        }
+        need(1);
+        continue;
+      }
+      case Opcode::ADD:
+      case Opcode::SUB:
+      case Opcode::ADD_NOCHECK:
+      case Opcode::SUB_NOCHECK:
+      case Opcode::MUL:
+      case Opcode::DIV:
+      case Opcode::MOD:
+      case Opcode::GREATER:
+      case Opcode::LOWER:
+      case Opcode::GREATER_EQ:
+      case Opcode::LOWER_EQ:
+      case Opcode::IS_EQ: {
+        need(2);
+        flow(start, pc, depth - 1);
+        continue;
+      }
+      case Opcode::RET: {
+        auto retDepth = prog.Read<unsigned>(pc);
+        auto retArgs = prog.Read<unsigned>(pc);
+        if (!isFunc) {
+          throw BytecodeError(start, "return outside of a function");
+        }
+        if (isGen) {
+          throw BytecodeError(start, "return from a generator");
+        }
+        need(1);
+        if (retDepth != depth - 1) {
+          std::ostringstream os;
+          os << "invalid return depth " << retDepth << ", expected " << depth - 1;
+          throw BytecodeError(start, os.str());
+        }
+        if (nargs && *nargs != retArgs) {
+          throw BytecodeError(start, "inconsistent argument count");
+        }
+        nargs = retArgs;
+        continue;
+      }
+      case Opcode::JUMP_FALSE:
+      case Opcode::JUMP_FALSE_INT: {
+        auto addr = prog.Read<size_t>(pc);
+        need(1);
+        flow(start, pc, depth - 1);
+        flow(start, addr, depth - 1);
+        continue;
+      }
+      case Opcode::JUMP: {
+        flow(start, prog.Read<size_t>(pc), depth);
+        continue;
+      }
+      case Opcode::LAZY: {
+        // The body is checked once it is compiled.
+        continue;
+      }
+      case Opcode::STOP: {
+        continue;
+      }
+    }
+  }
+
+  // Callers pass the number of arguments indicated by PUSH_FUNC, which must
+  // agree with the returns. It bounds the arguments of functions which
+  // never return.
+  if (isFunc) {
+    if (auto it = funcs_.find(entry); it != funcs_.end()) {
+      if (nargs && *nargs != it->second) {
+        throw BytecodeError(entry, "inconsistent function arity");
+      }
+      nargs = it->second;
+    }
+    if (!nargs) {
+      throw BytecodeError(entry, "unknown function arity");
+    }
+  }
+  if (maxArg && (!nargs || *maxArg >= *nargs)) {
+    throw BytecodeError(entry, "argument index out of bounds");
+  }
+}
+
+// -----------------------------------------------------------------------------
+void BytecodeVerifier::CheckTarget(size_t pc, size_t target)
+{
+  if (insts_.count(target) == 0) {
+    throw BytecodeError(pc, "target is not an instruction boundary");
+  }
+}
@@ -0,0 +1,69 @@
+// This file is part of the IMP project.
+
+#pragma once
+
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "program.h"
+
+
+
+/**
+ * Represents a malformed bytecode stream.
+ */
+class BytecodeError : public std::runtime_error {
+public:
+  BytecodeError(size_t pc, const std::string &msg);
+};
+
+/**
+ * Load-time checker for bytecode.
+ *
+ * The interpreter does not validate the instructions it executes: operands
+ * are decoded without bounds checks and the stack is assumed to hold enough
+ * values for every instruction. The verifier establishes these invariants
+ * once, before execution, by decoding the whole stream and simulating the
+ * depth of the stack along all control-flow paths.
+ *
+ * The top-level code starting at address 0 and all functions whose address
+ * is taken by PUSH_FUNC are checked separately, each with its own frame.
+ *
+ * The stack of a frame only holds the arguments it is called with if the
+ * callee takes that many. PUSH_FUNC and PUSH_PROTO carry the arity of the
+ * callee, which is checked against the returns of the function and the
+ * runtime method. Calls following them directly are checked here; calls
+ * to other values are only checked by the interpreter, when they happen.
+ * MAKE_CLOSURE must directly follow the PUSH_FUNC of its function.
+ */
+class BytecodeVerifier {
+public:
+  /// Checks the program, throwing a BytecodeError if it is malformed.
+  void Verify(const Program &prog);
+  /// Checks the code appended to the program since the last check, which
+  /// holds a function compiled on demand taking nargs arguments. The stub
+  /// of the function is only redirected to its entry once it is verified.
+  void Verify(const Program &prog, size_t entry, unsigned nargs);
+
+private:
+  /// Decodes the stream from the end of the part decoded so far, checking
+  /// opcodes and operand bounds. Returns the functions first seen.
+  std::vector<size_t> Decode(const Program &prog);
+  /// Simulates the stack depth in the frame starting at a given entry.
+  void VerifyFrame(const Program &prog, size_t entry, bool isFunc);
+
+  /// Check whether a target address is the start of an instruction.
+  void CheckTarget(size_t pc, size_t target);
+
+private:
+  /// Start addresses of all instructions.
+  std::set<size_t> insts_;
+  /// Entry points of functions, taken from PUSH_FUNC operands, mapped to
+  /// the number of arguments they take.
+  std::map<size_t, unsigned> funcs_;
+  /// End of the part of the stream decoded so far.
+  size_t decoded_ = 0;
+};
@@ -0,0 +1,357 @@
+// This file is part of the IMP project.
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+
+#include "callgraph.h"
+#include "runtime.h"
+
+
+
+// -----------------------------------------------------------------------------
+CallGraph::CallGraph(const Module &mod)
+{
+  // Create a node for each declaration.
+  for (auto item : mod) {
+    if (auto *func = std::get_if<std::shared_ptr<FuncDecl>>(&item)) {
+      auto &node = nodes_[(*func)->GetName()];
+      node.Name = (*func)->GetName();
+      node.Func = func->get();
+      node.IsPure = node.Func->HasAttr(FuncOrProtoDecl::Attr::PURE);
+    }
+    if (auto *proto = std::get_if<std::shared_ptr<ProtoDecl>>(&item)) {
+      auto &node = nodes_[(*proto)->GetName()];
+      node.Name = (*proto)->GetName();
+      node.Proto = proto->get();
+      auto it = kRuntimeFns.find(node.Proto->GetPrimitiveName());
+      node.IsPure = it != kRuntimeFns.end() && it->second.IsPure;
+    }
+  }
+
+  // Record the edges from function bodies and top-level statements.
+  for (auto item : mod) {
+    if (auto *func = std::get_if<std::shared_ptr<FuncDecl>>(&item)) {
+      auto &decl = **func;
+      if (!decl.HasBody()) {
+        continue;
+      }
+      scopes_.emplace_back();
+      for (auto it = decl.arg_begin(), end = decl.arg_end(); it != end; ++it) {
+        scopes_.back().insert(it->first);
+      }
+      caller_ = &nodes_[decl.GetName()];
+      TraverseStmt(decl.GetBody());
+      caller_ = nullptr;
+      scopes_.pop_back();
+    }
+    if (auto *stmt = std::get_if<std::shared_ptr<Stmt>>(&item)) {
+      scopes_.emplace_back();
+      TraverseStmt(**stmt);
+      scopes_.pop_back();
+    }
+  }
+
+  Classify();
+}
+
+// -----------------------------------------------------------------------------
+const CallGraph::Node *CallGraph::Find(const std::string &name) const
+{
+  auto it = nodes_.find(name);
+  return it == nodes_.end() ? nullptr : &it->second;
+}
+
+// -----------------------------------------------------------------------------
+bool CallGraph::TraverseBlockStmt(const BlockStmt &stmt)
+{
+  scopes_.emplace_back();
+  AstVisitor::TraverseBlockStmt(stmt);
+  scopes_.pop_back();
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+bool CallGraph::TraverseWhileStmt(const WhileStmt &stmt)
+{
+  loopDepth_++;
+  AstVisitor::TraverseWhileStmt(stmt);
+  loopDepth_--;
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+bool CallGraph::TraverseLetStmt(const LetStmt &stmt)
+{
+  AstVisitor::TraverseLetStmt(stmt);
+  scopes_.back().insert(stmt.GetName());
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+bool CallGraph::TraverseFuncExpr(const FuncExpr &expr)
+{
+  // Calls made by closures are attributed to the enclosing function.
+  auto &decl = expr.GetDecl();
+  scopes_.emplace_back();
+  for (auto it = decl.arg_begin(), end = decl.arg_end(); it != end; ++it) {
+    scopes_.back().insert(it->first);
+  }
+  AstVisitor::TraverseFuncExpr(expr);
+  scopes_.pop_back();
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+bool CallGraph::TraverseCallExpr(const CallExpr &call)
+{
+  for (auto it = call.arg_rbegin(), end = call.arg_rend(); it != end; ++it) {
+    TraverseExpr(**it);
+  }
+
+  auto &callee = call.GetCallee();
+  if (callee.GetKind() == Expr::Kind::REF) {
+    auto &name = static_cast<const RefExpr &>(callee).GetName();
+    if (auto *node = Resolve(name)) {
+      (caller_ ? caller_->Callees : roots_).insert(name);
+      (caller_ ? caller_->CallWeights : rootWeights_)[name] +=
+          std::pow(kLoopScale, loopDepth_);
+      node->CallSites++;
+      return true;
+    }
+  }
+  TraverseExpr(callee);
+  (caller_ ? caller_->HasIndirectCalls : rootIndirect_) = true;
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+bool CallGraph::VisitRefExpr(const RefExpr &expr)
+{
+  // A function used as a value might be called from anywhere.
+  if (auto *node = Resolve(expr.GetName())) {
+    node->IsAddressTaken = true;
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+CallGraph::Node *CallGraph::Resolve(const std::string &name)
+{
+  for (auto &scope : scopes_) {
+    if (scope.count(name)) {
+      return nullptr;
+    }
+  }
+  auto it = nodes_.find(name);
+  return it == nodes_.end() ? nullptr : &it->second;
+}
+
+// -----------------------------------------------------------------------------
+void CallGraph::Classify()
+{
+  std::vector<std::string> addressTaken;
+  for (auto &[name, node] : nodes_) {
+    if (node.IsAddressTaken && node.Func) {
+      addressTaken.push_back(name);
+    }
+  }
+
+  // Indirect calls might reach any function whose address is taken.
+  for (auto &[name, node] : nodes_) {
+    if (node.HasIndirectCalls) {
+      node.Callees.insert(addressTaken.begin(), addressTaken.end());
+    }
+  }
+  if (rootIndirect_) {
+    roots_.insert(addressTaken.begin(), addressTaken.end());
+  }
+
+  // Leaf functions only call prototypes, which do not create frames.
+  for (auto &[name, node] : nodes_) {
+    node.IsLeaf = std::none_of(
+        node.Callees.begin(),
+        node.Callees.end(),
+        [this] (const std::string &callee) { return nodes_[callee].Func; }
+    );
+  }
+
+  FindSCCs();
+  EstimateFrequencies();
+
+  // Find all functions reachable from the top-level code.
+  std::vector<std::string> queue(roots_.begin(), roots_.end());
+  while (!queue.empty()) {
+    auto &node = nodes_[queue.back()];
+    queue.pop_back();
+    if (node.IsReachable) {
+      continue;
+    }
+    node.IsReachable = true;
+    queue.insert(queue.end(), node.Callees.begin(), node.Callees.end());
+  }
+}
+
+// -----------------------------------------------------------------------------
+void CallGraph::FindSCCs()
+{
+  std::map<std::string, unsigned> index;
+  std::map<std::string, unsigned> lowlink;
+  std::vector<std::string> stack;
+  std::set<std::string> onStack;
+  unsigned nextIndex = 0;
+  unsigned nextSCC = 0;
+
+  std::function<void(const std::string &)> visit = [&] (const std::string &n) {
+    index[n] = lowlink[n] = nextIndex++;
+    stack.push_back(n);
+    onStack.insert(n);
+
+    for (auto &m : nodes_[n].Callees) {
+      if (!index.count(m)) {
+        visit(m);
+        lowlink[n] = std::min(lowlink[n], lowlink[m]);
+      } else if (onStack.count(m)) {
+        lowlink[n] = std::min(lowlink[n], index[m]);
+      }
+    }
+
+    if (lowlink[n] == index[n]) {
+      std::vector<std::string> scc;
+      do {
+        scc.push_back(stack.back());
+        onStack.erase(stack.back());
+        stack.pop_back();
+      } while (scc.back() != n);
+
+      for (auto &m : scc) {
+        auto &node = nodes_[m];
+        node.SCC = nextSCC;
+        node.IsRecursive = scc.size() > 1 || node.Callees.count(m);
+      }
+      nextSCC++;
+    }
+  };
+
+  for (auto &[name, node] : nodes_) {
+    if (!index.count(name)) {
+      visit(name);
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+void CallGraph::EstimateFrequencies()
+{
+  // Unknown targets of indirect calls are given the weight of one call.
+  auto weight = [] (const std::map<std::string, double> &weights, const std::string &n) {
+    auto it = weights.find(n);
+    return it == weights.end() ? 1.0 : it->second;
+  };
+
+  // Group nodes by component. Tarjan's algorithm numbers components in
+  // reverse topological order, so callers are visited before callees.
+  std::map<unsigned, std::vector<Node *>, std::greater<unsigned>> sccs;
+  for (auto &[name, node] : nodes_) {
+    sccs[node.SCC].push_back(&node);
+  }
+
+  std::map<std::string, double> incoming;
+  for (auto &callee : roots_) {
+    incoming[callee] += weight(rootWeights_, callee);
+  }
+  for (auto &[id, scc] : sccs) {
+    // Calls within a recursive component are assumed to repeat as often
+    // as a loop: all functions of the cycle share the incoming calls.
+    double total = 0;
+    for (auto *node : scc) {
+      total += incoming[node->Name];
+    }
+    for (auto *node : scc) {
+      if (node->IsRecursive) {
+        node->Frequency = std::min(total * kLoopScale, kMaxFrequency);
+      } else {
+        node->Frequency = incoming[node->Name];
+      }
+    }
+    for (auto *node : scc) {
+      for (auto &callee : node->Callees) {
+        if (nodes_[callee].SCC != id) {
+          incoming[callee] += node->Frequency * weight(node->CallWeights, callee);
+        }
+      }
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+void CallGraph::PrintDot(std::ostream &os) const
+{
+  os << "digraph callgraph {\n";
+  os << "  \"<top>\" [shape=box];\n";
+  for (auto &[name, node] : nodes_) {
+    os << "  \"" << name << "\" [";
+    os << "shape=" << (node.Func ? "ellipse" : "box");
+    if (node.IsLeaf && node.Func) {
+      os << ", peripheries=2";
+    }
+    if (node.IsRecursive) {
+      os << ", color=red";
+    }
+    if (!node.IsReachable) {
+      os << ", style=dashed";
+    }
+    os << "];\n";
+  }
+  for (auto &callee : roots_) {
+    os << "  \"<top>\" -> \"" << callee << "\";\n";
+  }
+  for (auto &[name, node] : nodes_) {
+    for (auto &callee : node.Callees) {
+      os << "  \"" << name << "\" -> \"" << callee << "\";\n";
+    }
+  }
+  os << "}\n";
+}
+
+// -----------------------------------------------------------------------------
+void CallGraph::PrintJson(std::ostream &os) const
+{
+  auto printList = [&os] (const std::set<std::string> &names) {
+    os << "[";
+    bool first = true;
+    for (auto &name : names) {
+      os << (first ? "" : ", ") << "\"" << name << "\"";
+      first = false;
+    }
+    os << "]";
+  };
+
+  os << "{\n";
+  os << "  \"roots\": ";
+  printList(roots_);
+  os << ",\n";
+  os << "  \"functions\": [";
+  bool first = true;
+  for (auto &[name, node] : nodes_) {
+    os << (first ? "\n" : ",\n");
+    first = false;
+    os << "    {";
+    os << "\"name\": \"" << name << "\", ";
+    os << "\"kind\": \"" << (node.Func ? "func" : "proto") << "\", ";
+    os << "\"callees\": ";
+    printList(node.Callees);
+    os << ", ";
+    os << "\"callSites\": " << node.CallSites << ", ";
+    os << "\"leaf\": " << (node.IsLeaf ? "true" : "false") << ", ";
+    os << "\"recursive\": " << (node.IsRecursive ? "true" : "false") << ", ";
+    os << "\"reachable\": " << (node.IsReachable ? "true" : "false") << ", ";
+    os << "\"addressTaken\": " << (node.IsAddressTaken ? "true" : "false") << ", ";
+    os << "\"pure\": " << (node.IsPure ? "true" : "false") << ", ";
+    os << "\"frequency\": " << node.Frequency << ", ";
+    os << "\"scc\": " << node.SCC;
+    os << "}";
+  }
+  os << "\n  ]\n";
+  os << "}\n";
+}
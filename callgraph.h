@@ -0,0 +1,129 @@
+// This file is part of the IMP project.
+
+#pragma once
+
+#include <map>
+#include <ostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "ast.h"
+#include "visitor.h"
+
+
+
+/**
+ * Module-level call graph.
+ *
+ * Edges are added for calls whose callee is the name of a function or
+ * a prototype which is not shadowed by an argument or a local. Functions
+ * whose address escapes into a value are conservatively assumed to be
+ * called from any indirect call site. Functions whose bodies were not
+ * parsed yet are assumed to make no calls.
+ *
+ * Without profile data, call frequencies are estimated statically: each
+ * loop enclosing a call site is assumed to iterate kLoopScale times, as
+ * are the cycles formed by recursive functions.
+ */
+class CallGraph : private AstVisitor<CallGraph> {
+public:
+  /// Information about a function or a prototype.
+  struct Node {
+    /// Name of the function.
+    std::string Name;
+    /// Declaration of the function, null for prototypes.
+    const FuncDecl *Func = nullptr;
+    /// Declaration of the prototype, null for functions.
+    const ProtoDecl *Proto = nullptr;
+    /// Functions and prototypes called directly.
+    std::set<std::string> Callees;
+    /// Number of static call sites targeting the function.
+    unsigned CallSites = 0;
+    /// Estimated number of calls to each callee per call of the function.
+    std::map<std::string, double> CallWeights;
+    /// Estimated number of calls per execution of the top-level code.
+    double Frequency = 0;
+    /// True if the function contains calls to unknown targets.
+    bool HasIndirectCalls = false;
+    /// True if the address of the function is used as a value.
+    bool IsAddressTaken = false;
+    /// True if the function does not call other functions.
+    bool IsLeaf = false;
+    /// True if the function is part of a cycle in the graph.
+    bool IsRecursive = false;
+    /// True if the function can be invoked from the top-level code.
+    bool IsReachable = false;
+    /// True if the function is declared @pure or is a pure runtime method.
+    bool IsPure = false;
+    /// Index of the strongly-connected component of the function.
+    unsigned SCC = 0;
+  };
+
+  using NodeMap = std::map<std::string, Node>;
+
+  /// Assumed number of iterations of each loop.
+  static constexpr double kLoopScale = 10;
+  /// Upper bound on estimated frequencies.
+  static constexpr double kMaxFrequency = 1e12;
+
+public:
+  /// Builds the call graph of a module.
+  CallGraph(const Module &mod);
+
+  /// Find the node of a function or prototype.
+  const Node *Find(const std::string &name) const;
+
+  NodeMap::const_iterator begin() const { return nodes_.begin(); }
+  NodeMap::const_iterator end() const { return nodes_.end(); }
+
+  /// Functions called directly from top-level statements.
+  const std::set<std::string> &GetRoots() const { return roots_; }
+
+  /// Print the graph in the DOT format.
+  void PrintDot(std::ostream &os) const;
+  /// Print the graph as a JSON object.
+  void PrintJson(std::ostream &os) const;
+
+private:
+  friend class AstVisitor<CallGraph>;
+
+  /// Opens the scope of a block.
+  bool TraverseBlockStmt(const BlockStmt &stmt);
+  /// Tracks the depth of loops.
+  bool TraverseWhileStmt(const WhileStmt &stmt);
+  /// Declares a local after its initialiser.
+  bool TraverseLetStmt(const LetStmt &stmt);
+  /// Opens the scope of the arguments of a closure.
+  bool TraverseFuncExpr(const FuncExpr &expr);
+  /// Records a direct or an indirect call.
+  bool TraverseCallExpr(const CallExpr &expr);
+  /// Records a function used as a value.
+  bool VisitRefExpr(const RefExpr &expr);
+
+  /// Find the global function or prototype a name refers to.
+  Node *Resolve(const std::string &name);
+
+  /// Classifies functions based on the edges of the graph.
+  void Classify();
+  /// Tarjan's algorithm, assigning components to nodes.
+  void FindSCCs();
+  /// Estimates the frequencies of calls, propagating them from the roots.
+  void EstimateFrequencies();
+
+private:
+  /// All functions and prototypes, indexed by name.
+  NodeMap nodes_;
+  /// Targets of the calls from top-level statements.
+  std::set<std::string> roots_;
+  /// True if the top-level code makes indirect calls.
+  bool rootIndirect_ = false;
+  /// Estimated number of calls to each function from the top-level code.
+  std::map<std::string, double> rootWeights_;
+  /// Function being visited, null for top-level statements.
+  Node *caller_ = nullptr;
+  /// Number of loops enclosing the statement being visited.
+  unsigned loopDepth_ = 0;
+  /// Names of arguments and locals in scope while visiting a function.
+  std::vector<std::set<std::string>> scopes_;
+};
@@ -0,0 +1,177 @@
+// This file is part of the IMP project.
+
+#include <algorithm>
+
+#include "closure.h"
+
+
+
+/**
+ * Looks for uses of a closure which prevent it from being lifted, in the
+ * statements following its declaration.
+ */
+class EscapeFinder final : public AstVisitor<EscapeFinder> {
+public:
+  EscapeFinder(const std::string &name, const FuncDecl &decl, const ClosureAnalysis::Info &info)
+    : name_(name)
+    , decl_(decl)
+    , info_(info)
+  {
+  }
+
+  bool TraverseCallExpr(const CallExpr &call)
+  {
+    // Direct calls with the right arguments pass the captures instead.
+    auto &callee = call.GetCallee();
+    if (nested_ == 0 &&
+        callee.GetKind() == Expr::Kind::REF &&
+        static_cast<const RefExpr &>(callee).GetName() == name_ &&
+        call.arg_size() == decl_.arg_size())
+    {
+      for (auto it = call.arg_rbegin(), end = call.arg_rend(); it != end; ++it) {
+        if (!TraverseExpr(**it)) {
+          return false;
+        }
+      }
+      return true;
+    }
+    return AstVisitor::TraverseCallExpr(call);
+  }
+
+  bool TraverseFuncExpr(const FuncExpr &expr)
+  {
+    // Closures calling the lifted one would have to capture its captures.
+    ++nested_;
+    bool result = AstVisitor::TraverseFuncExpr(expr);
+    --nested_;
+    return result;
+  }
+
+  bool VisitRefExpr(const RefExpr &expr) { return expr.GetName() != name_; }
+  bool VisitLetStmt(const LetStmt &stmt) { return !IsWatched(stmt.GetName()); }
+  bool VisitAssignStmt(const AssignStmt &stmt) { return !IsWatched(stmt.GetName()); }
+
+private:
+  /// Check whether a name refers to the closure or to one of its captures.
+  bool IsWatched(const std::string &name) const
+  {
+    auto &caps = info_.Captures;
+    return name == name_ || std::find(caps.begin(), caps.end(), name) != caps.end();
+  }
+
+private:
+  /// Name the closure is bound to.
+  const std::string &name_;
+  /// Declaration of the closure.
+  const FuncDecl &decl_;
+  /// Captures of the closure.
+  const ClosureAnalysis::Info &info_;
+  /// Number of closures enclosing the visited node.
+  unsigned nested_ = 0;
+};
+
+// -----------------------------------------------------------------------------
+void ClosureAnalysis::Analyse(const Module &mod)
+{
+  for (auto item : mod) {
+    if (auto *func = std::get_if<std::shared_ptr<FuncDecl>>(&item)) {
+      if ((*func)->HasBody()) {
+        AnalyseFunc(**func);
+      }
+    }
+    if (auto *stmt = std::get_if<std::shared_ptr<Stmt>>(&item)) {
+      frames_.push_back({ nullptr, { {} } });
+      TraverseStmt(**stmt);
+      frames_.pop_back();
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+void ClosureAnalysis::AnalyseFunc(const FuncDecl &decl)
+{
+  std::set<std::string> args;
+  for (auto it = decl.arg_begin(), end = decl.arg_end(); it != end; ++it) {
+    args.insert(it->first);
+  }
+  frames_.push_back({ nullptr, { args } });
+  TraverseStmt(decl.GetBody());
+  frames_.pop_back();
+}
+
+// -----------------------------------------------------------------------------
+bool ClosureAnalysis::TraverseBlockStmt(const BlockStmt &stmt)
+{
+  frames_.back().Scopes.emplace_back();
+  for (auto it = stmt.begin(), end = stmt.end(); it != end; ++it) {
+    TraverseStmt(**it);
+    if ((*it)->GetKind() != Stmt::Kind::LET) {
+      continue;
+    }
+    auto &let = static_cast<const LetStmt &>(**it);
+    auto init = let.GetInitialisation();
+    if (!init || init->GetKind() != Expr::Kind::FUNC) {
+      continue;
+    }
+
+    // The closure is only visible in the rest of the block.
+    auto &closure = static_cast<const FuncExpr &>(*init);
+    auto &info = infos_[&closure];
+    EscapeFinder finder(let.GetName(), closure.GetDecl(), info);
+    info.IsLifted = std::all_of(it + 1, end, [&finder] (auto &s) {
+      return finder.TraverseStmt(*s);
+    });
+  }
+  frames_.back().Scopes.pop_back();
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+bool ClosureAnalysis::TraverseLetStmt(const LetStmt &stmt)
+{
+  AstVisitor::TraverseLetStmt(stmt);
+  frames_.back().Scopes.back().insert(stmt.GetName());
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+bool ClosureAnalysis::TraverseFuncExpr(const FuncExpr &expr)
+{
+  auto &decl = expr.GetDecl();
+  std::set<std::string> args;
+  for (auto it = decl.arg_begin(), end = decl.arg_end(); it != end; ++it) {
+    args.insert(it->first);
+  }
+  infos_[&expr];
+  frames_.push_back({ &expr, { args } });
+  TraverseStmt(decl.GetBody());
+  frames_.pop_back();
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+bool ClosureAnalysis::VisitRefExpr(const RefExpr &expr)
+{
+  // Find the innermost function declaring the name. Names which are not
+  // declared by any of them refer to globals.
+  auto &name = expr.GetName();
+  for (size_t i = frames_.size(); i-- > 0; ) {
+    auto &scopes = frames_[i].Scopes;
+    bool found = std::any_of(scopes.begin(), scopes.end(), [&name] (auto &s) {
+      return s.count(name) != 0;
+    });
+    if (!found) {
+      continue;
+    }
+
+    // All the closures between the declaration and the use capture it.
+    for (size_t j = i + 1; j < frames_.size(); ++j) {
+      auto &caps = infos_[frames_[j].Closure].Captures;
+      if (std::find(caps.begin(), caps.end(), name) == caps.end()) {
+        caps.push_back(name);
+      }
+    }
+    return true;
+  }
+  return true;
+}
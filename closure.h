@@ -0,0 +1,80 @@
+// This file is part of the IMP project.
+
+#pragma once
+
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ast.h"
+#include "visitor.h"
+
+
+
+/**
+ * Capture and escape analysis of closures.
+ *
+ * A closure captures the arguments and locals of the enclosing functions
+ * which are referenced in its body, including the ones needed by the
+ * closures nested in it. The captured values are copied when the closure
+ * is created, so the enclosing function cannot observe changes to them.
+ *
+ * A closure bound by a let declaration does not escape if, in the rest of
+ * the block, its name is only called directly with the right number of
+ * arguments and neither the name nor the captured variables are assigned
+ * or declared again. Such closures are lifted: calls pass the captured
+ * variables as extra arguments, which hold the values they had when the
+ * closure was created, and no environment is allocated.
+ */
+class ClosureAnalysis : private AstVisitor<ClosureAnalysis> {
+public:
+  /// Information about a closure.
+  struct Info {
+    /// Captured arguments and locals, passed after the arguments.
+    std::vector<std::string> Captures;
+    /// True if the closure does not escape and can be lifted.
+    bool IsLifted = false;
+  };
+
+public:
+  /// Analyses the closures of all the functions and top-level statements.
+  void Analyse(const Module &mod);
+  /// Analyses the closures of a function, skipped earlier if its body was
+  /// not parsed.
+  void AnalyseFunc(const FuncDecl &decl);
+
+  /// Returns the information about a closure.
+  const Info &Find(const FuncExpr &expr) const
+  {
+    auto it = infos_.find(&expr);
+    assert(it != infos_.end() && "closure not analysed");
+    return it->second;
+  }
+
+private:
+  friend class AstVisitor<ClosureAnalysis>;
+
+  /// Opens a scope and decides which closures bound in the block are lifted.
+  bool TraverseBlockStmt(const BlockStmt &stmt);
+  /// Declares a local after its initialiser.
+  bool TraverseLetStmt(const LetStmt &stmt);
+  /// Finds the captures of a closure.
+  bool TraverseFuncExpr(const FuncExpr &expr);
+  /// Records a reference to a variable of an enclosing function.
+  bool VisitRefExpr(const RefExpr &expr);
+
+private:
+  /// Function or closure being analysed, along with its scopes.
+  struct Frame {
+    /// Closure, null for functions and top-level statements.
+    const FuncExpr *Closure;
+    /// Names of arguments and locals in scope.
+    std::vector<std::set<std::string>> Scopes;
+  };
+
+  /// Stack of the closures enclosing the node being visited.
+  std::vector<Frame> frames_;
+  /// Information about each closure.
+  std::unordered_map<const FuncExpr *, Info> infos_;
+};
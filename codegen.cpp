@@ -1,13 +1,70 @@
 // This file is part of the IMP project.
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <iostream>
 
 #include "codegen.h"
 #include "ast.h"
+#include "callgraph.h"
+#include "induction.h"
+#include "liveness.h"
+#include "visitor.h"
 
 
+
+// -----------------------------------------------------------------------------
+/**
+ * Matches a returned call, possibly multiplied by a factor: f(...), x * f(...)
+ * or f(...) * x. Returns the call and sets the factor, if any.
+ */
+static const CallExpr *MatchTailCall(const Expr &expr, const Expr *&factor)
+{
+  factor = nullptr;
+  if (expr.GetKind() == Expr::Kind::CALL) {
+    return static_cast<const CallExpr *>(&expr);
+  }
+  if (expr.GetKind() != Expr::Kind::BINARY) {
+    return nullptr;
+  }
+  auto &binary = static_cast<const BinaryExpr &>(expr);
+  if (binary.GetKind() != BinaryExpr::Kind::MUL) {
+    return nullptr;
+  }
+  if (binary.GetRHS().GetKind() == Expr::Kind::CALL) {
+    factor = &binary.GetLHS();
+    return static_cast<const CallExpr *>(&binary.GetRHS());
+  }
+  if (binary.GetLHS().GetKind() == Expr::Kind::CALL) {
+    factor = &binary.GetRHS();
+    return static_cast<const CallExpr *>(&binary.GetLHS());
+  }
+  return nullptr;
+}
+
+// -----------------------------------------------------------------------------
+/**
+ * Returns the divisor of a division or modulo by a constant which can be
+ * replaced with a multiplication, if there is one.
+ */
+static std::optional<int64_t> GetConstDivisor(const BinaryExpr &binary)
+{
+  auto kind = binary.GetKind();
+  if (kind != BinaryExpr::Kind::DIV && kind != BinaryExpr::Kind::MOD) {
+    return std::nullopt;
+  }
+  if (binary.GetRHS().GetKind() != Expr::Kind::INT) {
+    return std::nullopt;
+  }
+  auto &rhs = static_cast<const IntExpr &>(binary.GetRHS());
+  auto d = static_cast<int64_t>(rhs.GetNumber());
+  if (!DivMagic::IsValid(d)) {
+    return std::nullopt;
+  }
+  return d;
+}
+
 // -----------------------------------------------------------------------------
 Codegen::Scope::~Scope()
 {
@@ -59,17 +116,45 @@ Codegen::Binding Codegen::BlockScope::Lookup(const std::string &name) const
     binding.Index = i->second;
     return binding;
   }
+  if (auto i = closures_.find(name); i != closures_.end()) {
+    Binding binding;
+    binding.Kind = Binding::Kind::CLOSURE;
+    binding.Closure = i->second;
+    return binding;
+  }
   return parent_->Lookup(name);
 }
 
+// -----------------------------------------------------------------------------
+const std::string *Codegen::BlockScope::GetLocalAt(uint32_t pos) const
+{
+  for (auto &[name, index] : locals_) {
+    if (index == pos) {
+      return &name;
+    }
+  }
+  return nullptr;
+}
+
 // -----------------------------------------------------------------------------
 std::unique_ptr<Program> Codegen::Translate(const Module &mod)
 {
   assert(code_.empty() && "expected empty code section");
 
+  // Clone the functions called with constant arguments.
+  specs_.Run(mod);
+
+  // Find the arithmetic operations which cannot overflow.
+  ranges_.Analyse(mod);
+  for (auto &clone : specs_.GetClones()) {
+    ranges_.AnalyseFunc(*clone);
+  }
+
+  // Find the closures which do not escape.
+  closures_.Analyse(mod);
+
   // Traverse all the function & function prototype declarations and record
   // them in the global symbol table.
-  std::map<std::string, RuntimeFn> protos;
   for (auto item : mod) {
     if (std::holds_alternative<std::shared_ptr<ProtoDecl>>(item)) {
       // The name of the prototype is mapped to the pointer
@@ -77,19 +162,32 @@ std::unique_ptr<Program> Codegen::Translate(const Module &mod)
       auto &proto = *std::get<1>(item);
       auto it = kRuntimeFns.find(proto.GetPrimitiveName());
       assert(it != kRuntimeFns.end() && "missing prototype");
-      protos.emplace(proto.GetName(), it->second);
+      protos_.emplace(proto.GetName(), it->second.Fn);
+      arities_.emplace(proto.GetName(), it->second.NumArgs);
+      if (it->second.IsPure) {
+        pure_.insert(proto.GetName());
+      }
     }
     if (std::holds_alternative<std::shared_ptr<FuncDecl>>(item)) {
       // Map the function to a newly created label, which will be used
       // as the address to be invoked by call instructions.
       auto &func = *std::get<0>(item);
       funcs_.emplace(func.GetName(), MakeLabel());
+      arities_.emplace(func.GetName(), func.arg_size());
+      if (func.HasAttr(FuncOrProtoDecl::Attr::PURE)) {
+        pure_.insert(func.GetName());
+      }
     }
   }
+  for (auto &clone : specs_.GetClones()) {
+    funcs_.emplace(clone->GetName(), MakeLabel());
+    arities_.emplace(clone->GetName(), clone->arg_size());
+  }
+  FindTrapFree(mod);
 
   // Compile all top-level statements in the beginning, to ensure that the
   // instruction at the start of the bytecode stream starts the program.
-  GlobalScope global(funcs_, protos);
+  GlobalScope global(funcs_, protos_);
   for (auto item : mod) {
     if (!std::holds_alternative<std::shared_ptr<Stmt>>(item)) {
       continue;
@@ -98,17 +196,89 @@ std::unique_ptr<Program> Codegen::Translate(const Module &mod)
   }
   Emit<Opcode>(Opcode::STOP);
 
-  // Emit code for all functions.
-  for (auto item : mod) {
-    if (!std::holds_alternative<std::shared_ptr<FuncDecl>>(item)) {
-      continue;
+  // Emit code for all functions and clones, from the hottest to the coldest.
+  for (auto *func : GetLayout(mod)) {
+    if (func->HasBody()) {
+      LowerFuncDecl(global, *func);
+    } else {
+      EmitLabel(funcs_.at(func->GetName()));
+      EmitLazy(lazy_.size());
+      lazy_.push_back(func);
     }
-    LowerFuncDecl(global, *std::get<0>(item));
   }
+  LowerClosures(global);
 
   return std::make_unique<Program>(std::move(code_));
 }
 
+// -----------------------------------------------------------------------------
+size_t Codegen::TranslateLazy(size_t id, Program &prog)
+{
+  auto &func = *lazy_[id];
+  ranges_.AnalyseFunc(func);
+  closures_.AnalyseFunc(func);
+
+  // The entry label is bound to the stub, so the body is emitted after a
+  // fresh label at the end of the program.
+  code_.clear();
+  base_ = prog.GetSize();
+  GlobalScope global(funcs_, protos_);
+  LowerFuncDecl(global, func);
+  LowerClosures(global);
+  assert(fixups_.empty() && "unresolved labels in function");
+  return prog.Append(code_);
+}
+
+// -----------------------------------------------------------------------------
+std::vector<const FuncDecl *> Codegen::GetLayout(const Module &mod)
+{
+  std::vector<const FuncDecl *> funcs;
+  for (auto item : mod) {
+    if (std::holds_alternative<std::shared_ptr<FuncDecl>>(item)) {
+      funcs.push_back(std::get<0>(item).get());
+    }
+  }
+
+  // Functions marked @hot come first, followed by the ones reachable from
+  // the top-level code, ordered by their estimated call frequency. Cold
+  // functions and the ones which are never called are placed at the end.
+  CallGraph graph(mod);
+  auto rank = [&graph] (const FuncDecl *func) {
+    if (func->HasAttr(FuncOrProtoDecl::Attr::HOT)) {
+      return 0;
+    }
+    if (func->HasAttr(FuncOrProtoDecl::Attr::COLD)) {
+      return 2;
+    }
+    return graph.Find(func->GetName())->IsReachable ? 1 : 3;
+  };
+  auto freq = [&graph] (const FuncDecl *func) {
+    return graph.Find(func->GetName())->Frequency;
+  };
+  std::stable_sort(
+      funcs.begin(),
+      funcs.end(),
+      [&] (const FuncDecl *a, const FuncDecl *b) {
+        if (rank(a) != rank(b)) {
+          return rank(a) < rank(b);
+        }
+        return freq(a) > freq(b);
+      }
+  );
+
+  // Clones are placed right after the function they were created from.
+  std::vector<const FuncDecl *> layout;
+  for (auto *func : funcs) {
+    layout.push_back(func);
+    for (auto &clone : specs_.GetClones()) {
+      if (&specs_.GetOriginal(*clone) == func) {
+        layout.push_back(clone.get());
+      }
+    }
+  }
+  return layout;
+}
+
 // -----------------------------------------------------------------------------
 void Codegen::LowerStmt(Scope &scope, const Stmt &stmt)
 {
@@ -128,9 +298,15 @@ void Codegen::LowerStmt(Scope &scope, const Stmt &stmt)
     case Stmt::Kind::RETURN: {
       return LowerReturnStmt(scope, static_cast<const ReturnStmt &>(stmt));
     }
+    case Stmt::Kind::YIELD: {
+      return LowerYieldStmt(scope, static_cast<const YieldStmt &>(stmt));
+    }
     case Stmt::Kind::LET: {
       return LowerLetStmt(scope, static_cast<const LetStmt &>(stmt));
     }
+    case Stmt::Kind::ASSIGN: {
+      return LowerAssignStmt(scope, static_cast<const AssignStmt &>(stmt));
+    }
   }
 }
 
@@ -139,17 +315,55 @@ void Codegen::LowerBlockStmt(Scope &scope, const BlockStmt &blockStmt)
 {
   unsigned depthIn = depth_;
 
+  BlockLiveness live(blockStmt);
   BlockScope blockScope(&scope);
+  size_t i = 0;
   for (auto &stmt : blockStmt) {
+    // Expressions do not branch, so a local used for the last time in a
+    // straight-line statement can be consumed from its slot instead of
+    // being copied, if it happens to be on top of the stack.
+    auto kind = stmt->GetKind();
+    if (kind == Stmt::Kind::LET || kind == Stmt::Kind::ASSIGN ||
+        kind == Stmt::Kind::EXPR || kind == Stmt::Kind::RETURN ||
+        kind == Stmt::Kind::YIELD) {
+      for (auto &s : blockStmt) {
+        if (s->GetKind() != Stmt::Kind::LET) {
+          continue;
+        }
+        auto &name = static_cast<const LetStmt &>(*s).GetName();
+        if (blockScope.HasLocal(name) && live.IsLastUse(i, name)) {
+          movable_.insert(name);
+        }
+      }
+    }
+
     LowerStmt(blockScope, *stmt);
-  }
 
+    // The slot of a moved local now holds a temporary or a new local.
+    for (auto &name : moved_) {
+      if (kind != Stmt::Kind::LET || static_cast<const LetStmt &>(*stmt).GetName() != name) {
+        blockScope.RemoveLocal(name);
+      }
+    }
+    movable_.clear();
+    moved_.clear();
 
-  for(int i = 0; i < blockScope.NumberOfLocals(); i++) {
-    EmitPop();
+    // Release the slots of dead locals from the top of the stack.
+    unsigned n = 0;
+    while (depth_ - n > depthIn) {
+      auto *name = blockScope.GetLocalAt(depth_ - n);
+      if (name && live.IsLiveAfter(i, *name)) {
+        break;
+      }
+      if (name) {
+        blockScope.RemoveLocal(*name);
+      }
+      ++n;
+    }
+    EmitPopN(n);
+    ++i;
   }
 
-
   assert(depth_ == depthIn && "mismatched block depth on exit");
 }
 
@@ -159,12 +373,48 @@ void Codegen::LowerWhileStmt(Scope &scope, const WhileStmt &whileStmt)
   auto entry = MakeLabel();
   auto exit = MakeLabel();
 
+  // The body of small loops is replicated, each copy being guarded by its
+  // own test of the condition. The backward jump is only taken once every
+  // few iterations and no remainder loop is needed, since each iteration
+  // can leave the loop regardless of the trip count.
+  unsigned copies = 1;
+  auto size = CountNodes(whileStmt.GetCond()) + CountNodes(whileStmt.GetStmt());
+  if (size <= opts_.UnrollBudget) {
+    copies = std::max(opts_.UnrollFactor, 1u);
+  }
+
+  // Products of induction variables with constants are computed before the
+  // loop into hidden slots, advanced by an addition after each update of
+  // the variable. The names of the slots cannot clash with identifiers.
+  unsigned depthIn = depth_;
+  BlockScope loopScope(&scope);
+  InductionAnalysis ivs(whileStmt);
+  for (auto &iv : ivs) {
+    auto name = iv.Base + "*" + std::to_string(iv.Scale);
+    LowerBinaryExpr(scope, *iv.Exprs[0]);
+    loopScope.AddLocal(name, depth_);
+    for (auto *expr : iv.Exprs) {
+      derived_.emplace(expr, name);
+    }
+    updates_[iv.Update].emplace_back(name, iv.Step);
+  }
+
   EmitLabel(entry);
-  LowerExpr(scope, whileStmt.GetCond());
-  EmitJumpFalse(exit);
-  LowerStmt(scope, whileStmt.GetStmt());
+  for (unsigned i = 0; i < copies; ++i) {
+    LowerExpr(loopScope, whileStmt.GetCond());
+    EmitJumpFalse(exit);
+    LowerStmt(loopScope, whileStmt.GetStmt());
+  }
   EmitJump(entry);
   EmitLabel(exit);
+
+  for (auto &iv : ivs) {
+    for (auto *expr : iv.Exprs) {
+      derived_.erase(expr);
+    }
+    updates_.erase(iv.Update);
+  }
+  EmitPopN(depth_ - depthIn);
 }
 
 
@@ -190,23 +440,98 @@ void Codegen::LowerIfStmt(Scope &scope, const IfStmt &ifStmt)
 // -----------------------------------------------------------------------------
 void Codegen::LowerLetStmt(Scope &scope, const LetStmt &letStmt)
 {
+  // Lifted closures need no slot: their calls pass the captures instead.
+  if (auto init = letStmt.GetInitialisation()) {
+    if (init->GetKind() == Expr::Kind::FUNC) {
+      auto &closure = static_cast<const FuncExpr &>(*init);
+      if (closures_.Find(closure).IsLifted) {
+        GetClosureLabel(closure);
+        scope.AddClosure(letStmt.GetName(), &closure);
+        return;
+      }
+    }
+  }
+
   if(auto init = letStmt.GetInitialisation()) {
     LowerExpr(scope, *init);
+  } else {
+    EmitInt(0);
   }
-  // LowerExpr(scope, letStmt.GetInitialisation());
   scope.AddLocal(letStmt.GetName(), (uint32_t)depth_);
 }
 
+// -----------------------------------------------------------------------------
+void Codegen::LowerAssignStmt(const Scope &scope, const AssignStmt &assignStmt)
+{
+  LowerExpr(scope, assignStmt.GetExpr());
+
+  // Slots are indexed from the top of the stack once the value is popped.
+  auto binding = scope.Lookup(assignStmt.GetName());
+  switch (binding.Kind) {
+    case Binding::Kind::ARG: {
+      EmitStore(depth_ + binding.Index);
+      break;
+    }
+    case Binding::Kind::LOCAL: {
+      EmitStore(depth_ - 1 - binding.Index);
+      break;
+    }
+    case Binding::Kind::FUNC:
+    case Binding::Kind::PROTO:
+    case Binding::Kind::CLOSURE: {
+      // The verifier should reject assignments to globals and lifted
+      // closures are never assigned.
+      assert(!"cannot assign to a global");
+      return;
+    }
+  }
+
+  // Advance the products of an induction variable along with it.
+  if (auto it = updates_.find(&assignStmt); it != updates_.end()) {
+    for (auto &[name, step] : it->second) {
+      auto slot = scope.Lookup(name);
+      EmitPeek(depth_ - slot.Index);
+      EmitInt(step);
+      EmitAddNoCheck();
+      EmitStore(depth_ - 1 - slot.Index);
+    }
+  }
+}
+
 // -----------------------------------------------------------------------------
 void Codegen::LowerReturnStmt(const Scope &scope, const ReturnStmt &retStmt)
 {
+  if (isGenerator_) {
+    LowerExpr(scope, retStmt.GetExpr());
+    EmitGenReturn();
+    return;
+  }
+  if (loopHead_ && LowerTailCall(scope, retStmt.GetExpr())) {
+    return;
+  }
   LowerExpr(scope, retStmt.GetExpr());
+  if (acc_) {
+    // Apply the factors of the calls which were turned into jumps.
+    EmitPeek(depth_ - *acc_);
+    EmitMul();
+  }
   EmitReturn();
 }
 
+// -----------------------------------------------------------------------------
+void Codegen::LowerYieldStmt(const Scope &scope, const YieldStmt &yieldStmt)
+{
+  LowerExpr(scope, yieldStmt.GetExpr());
+  EmitGenYield();
+}
+
 // -----------------------------------------------------------------------------
 void Codegen::LowerExprStmt(const Scope &scope, const ExprStmt &exprStmt)
 {
+  // Skip expressions with no effects, such as calls to pure functions.
+  if (IsRemovable(scope, exprStmt.GetExpr())) {
+    return;
+  }
   LowerExpr(scope, exprStmt.GetExpr());
   EmitPop();
 }
@@ -227,6 +552,9 @@ void Codegen::LowerExpr(const Scope &scope, const Expr &expr)
     case Expr::Kind::INT: {
       return LowerIntExpr(scope, static_cast<const IntExpr &>(expr));
     }
+    case Expr::Kind::FUNC: {
+      return LowerFuncExpr(scope, static_cast<const FuncExpr &>(expr));
+    }
   }
 }
 
@@ -236,11 +564,11 @@ void Codegen::LowerRefExpr(const Scope &scope, const RefExpr &expr)
   auto binding = scope.Lookup(expr.GetName());
   switch (binding.Kind) {
     case Binding::Kind::FUNC: {
-      EmitPushFunc(binding.Entry);
+      EmitPushFunc(binding.Entry, arities_.at(expr.GetName()));
       return;
     }
     case Binding::Kind::PROTO: {
-      EmitPushProto(binding.Fn);
+      EmitPushProto(binding.Fn, arities_.at(expr.GetName()));
       return;
     }
     case Binding::Kind::ARG: {
@@ -248,23 +576,52 @@ void Codegen::LowerRefExpr(const Scope &scope, const RefExpr &expr)
       return;
     }
     case Binding::Kind::LOCAL: {
+      if (binding.Index == depth_ && movable_.erase(expr.GetName())) {
+        // The value is already on top of the stack: take it over.
+        moved_.insert(expr.GetName());
+        return;
+      }
       EmitPeek(depth_ - binding.Index);
       return;
     }
+    case Binding::Kind::CLOSURE: {
+      // Lifted closures are only called directly.
+      assert(!"lifted closure used as a value");
+      return;
+    }
   }
 }
 
 // -----------------------------------------------------------------------------
 void Codegen::LowerBinaryExpr(const Scope &scope, const BinaryExpr &binary)
 {
-  LowerExpr(scope, binary.GetLHS());
-  LowerExpr(scope, binary.GetRHS());
+  // Products of induction variables are read from their slots.
+  if (auto it = derived_.find(&binary); it != derived_.end()) {
+    EmitPeek(depth_ - scope.Lookup(it->second).Index);
+    return;
+  }
+
+  // Constant divisors use a multiplication and need no zero check.
+  if (auto d = GetConstDivisor(binary)) {
+    LowerExpr(scope, binary.GetLHS());
+    if (binary.GetKind() == BinaryExpr::Kind::DIV) {
+      EmitDivConst(*d);
+    } else {
+      EmitModConst(*d);
+    }
+    return;
+  }
+
+  if (!LowerInPlace(scope, { &binary.GetLHS(), &binary.GetRHS() })) {
+    LowerExpr(scope, binary.GetLHS());
+    LowerExpr(scope, binary.GetRHS());
+  }
   switch (binary.GetKind()) {
     case BinaryExpr::Kind::ADD: {
-      return EmitAdd();
+      return ranges_.IsOverflowFree(binary) ? EmitAddNoCheck() : EmitAdd();
     }
     case BinaryExpr::Kind::SUB: {
-      return EmitSub();
+      return ranges_.IsOverflowFree(binary) ? EmitSubNoCheck() : EmitSub();
     }
     case BinaryExpr::Kind::MUL: {
       return EmitMul();
@@ -296,12 +653,187 @@ void Codegen::LowerBinaryExpr(const Scope &scope, const BinaryExpr &binary)
 // -----------------------------------------------------------------------------
 void Codegen::LowerCallExpr(const Scope &scope, const CallExpr &call)
 {
+  auto *clone = specs_.Find(call);
+  auto args = GetCallArgs(call);
+
+  // Lifted closures take the captured variables after their arguments.
+  const FuncExpr *closure = nullptr;
+  auto &callee = call.GetCallee();
+  if (callee.GetKind() == Expr::Kind::REF) {
+    auto binding = scope.Lookup(static_cast<const RefExpr &>(callee).GetName());
+    if (binding.Kind == Binding::Kind::CLOSURE) {
+      closure = binding.Closure;
+    }
+  }
+  size_t nargs = args.size();
+  if (closure) {
+    auto &captures = closures_.Find(*closure).Captures;
+    for (auto it = captures.rbegin(); it != captures.rend(); ++it) {
+      LowerCapture(scope, *it);
+    }
+    nargs += captures.size();
+  }
+
+  if (nargs != args.size() || !LowerInPlace(scope, args)) {
+    for (auto *arg : args) {
+      LowerExpr(scope, *arg);
+    }
+  }
+  if (clone) {
+    EmitPushFunc(funcs_.at(clone->GetName()), arities_.at(clone->GetName()));
+  } else if (closure) {
+    auto entry = GetClosureLabel(*closure);
+    EmitPushFunc(entry, arities_.at(closure->GetDecl().GetName()));
+  } else {
+    LowerExpr(scope, callee);
+  }
+  EmitCall(nargs);
+  depth_ -= nargs;
+}
+
+// -----------------------------------------------------------------------------
+std::vector<const Expr *> Codegen::GetCallArgs(const CallExpr &call)
+{
+  // Calls with constant arguments are redirected to a specialised clone,
+  // which only takes the arguments that are not integer literals.
+  auto *clone = specs_.Find(call);
+
+  std::vector<const Expr *> args;
   for (auto it = call.arg_rbegin(), end = call.arg_rend(); it != end; ++it) {
-    LowerExpr(scope, **it);
+    if (!clone || (*it)->GetKind() != Expr::Kind::INT) {
+      args.push_back(it->get());
+    }
+  }
+  return args;
+}
+
+// -----------------------------------------------------------------------------
+bool Codegen::LowerTailCall(const Scope &scope, const Expr &expr)
+{
+  const Expr *factor;
+  auto *call = MatchTailCall(expr, factor);
+  if (!call || !IsSelfCall(scope, *call)) {
+    return false;
+  }
+  if (factor && (!acc_ || !IsSafeFactor(scope, *factor))) {
+    return false;
+  }
+
+  // The product is associative and commutative, as it wraps around: the
+  // factor is multiplied into the accumulator instead of the result.
+  if (factor) {
+    EmitPeek(depth_ - *acc_);
+    LowerExpr(scope, *factor);
+    EmitMul();
+    EmitStore(depth_ - 1 - *acc_);
+  }
+
+  // Evaluate the arguments as for a call, then overwrite the arguments
+  // of the frame, drop the locals and jump back to the start of the body.
+  auto args = GetCallArgs(*call);
+  for (auto *arg : args) {
+    LowerExpr(scope, *arg);
+  }
+  for (size_t i = 0; i < args.size(); ++i) {
+    EmitStore(depth_ + i);
+  }
+  auto depth = depth_;
+  EmitPopN(depth_ - (acc_ ? 1 : 0));
+  EmitJump(*loopHead_);
+  depth_ = depth;
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+bool Codegen::IsSelfCall(const Scope &scope, const CallExpr &call)
+{
+  if (!func_ || GetCallArgs(call).size() != func_->arg_size()) {
+    return false;
+  }
+  if (auto *clone = specs_.Find(call)) {
+    return clone == func_;
+  }
+  auto &callee = call.GetCallee();
+  if (callee.GetKind() != Expr::Kind::REF) {
+    return false;
+  }
+  auto &name = static_cast<const RefExpr &>(callee).GetName();
+  return name == func_->GetName() && scope.Lookup(name).Kind == Binding::Kind::FUNC;
+}
+
+// -----------------------------------------------------------------------------
+bool Codegen::IsSafeFactor(const Scope &scope, const Expr &expr)
+{
+  // Factors are evaluated before the call instead of after it returns,
+  // so they must not fail or have side effects.
+  switch (expr.GetKind()) {
+    case Expr::Kind::REF: {
+      auto kind = scope.Lookup(static_cast<const RefExpr &>(expr).GetName()).Kind;
+      return kind == Binding::Kind::ARG || kind == Binding::Kind::LOCAL;
+    }
+    case Expr::Kind::INT: {
+      return true;
+    }
+    case Expr::Kind::BINARY: {
+      auto &binary = static_cast<const BinaryExpr &>(expr);
+      return binary.GetKind() == BinaryExpr::Kind::MUL
+          && IsSafeFactor(scope, binary.GetLHS())
+          && IsSafeFactor(scope, binary.GetRHS());
+    }
+    case Expr::Kind::CALL:
+    case Expr::Kind::FUNC: {
+      return false;
+    }
   }
-  LowerExpr(scope, call.GetCallee());
-  EmitCall(call.arg_size());
-  depth_ -= call.arg_size();
+  return false;
+}
+
+// -----------------------------------------------------------------------------
+bool Codegen::LowerInPlace(const Scope &scope, const std::vector<const Expr *> &exprs)
+{
+  // If the operands are the last uses of the locals occupying the top
+  // slots of the stack, the values are reordered with SWAP and ROT
+  // instead of being copied.
+  unsigned n = exprs.size();
+  if (n < 2 || n > 3) {
+    return false;
+  }
+
+  // Position of each operand, counting from the lowest of the top slots.
+  std::vector<unsigned> pos;
+  for (auto *expr : exprs) {
+    if (expr->GetKind() != Expr::Kind::REF) {
+      return false;
+    }
+    auto &name = static_cast<const RefExpr &>(*expr).GetName();
+    if (!movable_.count(name)) {
+      return false;
+    }
+    auto binding = scope.Lookup(name);
+    if (binding.Kind != Binding::Kind::LOCAL || binding.Index + n <= depth_) {
+      return false;
+    }
+    pos.push_back(binding.Index + n - 1 - depth_);
+  }
+
+  for (auto *expr : exprs) {
+    auto &name = static_cast<const RefExpr &>(*expr).GetName();
+    movable_.erase(name);
+    moved_.insert(name);
+  }
+  if (n == 2) {
+    if (pos[0] == 1) {
+      EmitSwap();
+    }
+    return true;
+  }
+  for (unsigned i = 0; i < pos[0]; ++i) {
+    EmitRot();
+  }
+  if (pos[1] != (pos[0] + 1) % 3) {
+    EmitSwap();
+  }
+  return true;
 }
 
 // -----------------------------------------------------------------------------
@@ -311,28 +843,321 @@ void Codegen::LowerIntExpr(const Scope &scope, const IntExpr &number)
 }
 
 // -----------------------------------------------------------------------------
-void Codegen::LowerFuncDecl(const Scope &scope, const FuncDecl &decl)
+void Codegen::LowerFuncExpr(const Scope &scope, const FuncExpr &expr)
+{
+  // Closures which capture nothing are plain functions. Otherwise, the
+  // captures are copied into an environment, in the order calls pass them.
+  auto entry = GetClosureLabel(expr);
+  auto &captures = closures_.Find(expr).Captures;
+  for (auto it = captures.rbegin(); it != captures.rend(); ++it) {
+    LowerCapture(scope, *it);
+  }
+  EmitPushFunc(entry, arities_.at(expr.GetDecl().GetName()));
+  if (!captures.empty()) {
+    EmitMakeClosure(captures.size());
+  }
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::LowerCapture(const Scope &scope, const std::string &name)
+{
+  auto binding = scope.Lookup(name);
+  switch (binding.Kind) {
+    case Binding::Kind::ARG: {
+      EmitPeek(depth_ + binding.Index + 1);
+      return;
+    }
+    case Binding::Kind::LOCAL: {
+      EmitPeek(depth_ - binding.Index);
+      return;
+    }
+    case Binding::Kind::FUNC:
+    case Binding::Kind::PROTO:
+    case Binding::Kind::CLOSURE: {
+      assert(!"captures are arguments or locals");
+      return;
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+Codegen::Label Codegen::GetClosureLabel(const FuncExpr &expr)
+{
+  auto &name = expr.GetDecl().GetName();
+  if (auto it = funcs_.find(name); it != funcs_.end()) {
+    return it->second;
+  }
+  auto entry = MakeLabel();
+  funcs_.emplace(name, entry);
+  auto &captures = closures_.Find(expr).Captures;
+  arities_.emplace(name, expr.GetDecl().arg_size() + captures.size());
+  pending_.push_back(&expr);
+  return entry;
+}
+
+// -----------------------------------------------------------------------------
+unsigned Codegen::CountNodes(const Stmt &stmt)
+{
+  NodeCounter counter;
+  counter.TraverseStmt(stmt);
+  return counter.Count;
+}
+
+// -----------------------------------------------------------------------------
+unsigned Codegen::CountNodes(const Expr &expr)
+{
+  NodeCounter counter;
+  counter.TraverseExpr(expr);
+  return counter.Count;
+}
+
+// -----------------------------------------------------------------------------
+bool Codegen::IsRemovable(const Scope &scope, const Expr &expr)
+{
+  // Looks for operations which might have side effects or raise errors.
+  class EffectFinder final : public AstVisitor<EffectFinder> {
+  public:
+    EffectFinder(const Codegen &codegen, const Scope &scope)
+      : codegen_(codegen)
+      , scope_(scope)
+    {
+    }
+
+    bool VisitBinaryExpr(const BinaryExpr &binary)
+    {
+      return codegen_.IsTrapFree(binary);
+    }
+
+    bool VisitCallExpr(const CallExpr &call)
+    {
+      auto &callee = call.GetCallee();
+      if (callee.GetKind() != Expr::Kind::REF) {
+        return false;
+      }
+      auto &name = static_cast<const RefExpr &>(callee).GetName();
+      auto kind = scope_.Lookup(name).Kind;
+      if (kind != Binding::Kind::FUNC && kind != Binding::Kind::PROTO) {
+        return false;
+      }
+      return codegen_.trapFree_.count(name) != 0;
+    }
+
+    bool TraverseFuncExpr(const FuncExpr &)
+    {
+      // Creating a closure has no effects.
+      return true;
+    }
+
+  private:
+    const Codegen &codegen_;
+    const Scope &scope_;
+  };
+
+  return EffectFinder(*this, scope).TraverseExpr(expr);
+}
+
+// -----------------------------------------------------------------------------
+bool Codegen::IsTrapFree(const BinaryExpr &binary) const
+{
+  switch (binary.GetKind()) {
+    case BinaryExpr::Kind::ADD:
+    case BinaryExpr::Kind::SUB: {
+      return ranges_.IsOverflowFree(binary);
+    }
+    case BinaryExpr::Kind::DIV:
+    case BinaryExpr::Kind::MOD: {
+      return GetConstDivisor(binary).has_value();
+    }
+    default: {
+      return true;
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::FindTrapFree(const Module &mod)
+{
+  // Looks for operations which might raise errors in a function body.
+  class TrapFinder final : public AstVisitor<TrapFinder> {
+  public:
+    TrapFinder(const Codegen &codegen) : codegen_(codegen) {}
+
+    bool VisitBinaryExpr(const BinaryExpr &binary)
+    {
+      return codegen_.IsTrapFree(binary);
+    }
+
+  private:
+    const Codegen &codegen_;
+  };
+
+  // Pure runtime methods cannot fail. Functions cannot fail if their body
+  // has no checked operations, unless they call a function which can.
+  CallGraph graph(mod);
+  for (auto &[name, node] : graph) {
+    if (pure_.count(name) == 0) {
+      continue;
+    }
+    if (node.Proto) {
+      trapFree_.insert(name);
+      continue;
+    }
+    if (!node.Func->HasBody() || node.HasIndirectCalls) {
+      continue;
+    }
+    if (TrapFinder(*this).TraverseStmt(node.Func->GetBody())) {
+      trapFree_.insert(name);
+    }
+  }
+  for (bool changed = true; changed; ) {
+    changed = false;
+    for (auto it = trapFree_.begin(); it != trapFree_.end(); ) {
+      auto &callees = graph.Find(*it)->Callees;
+      bool safe = std::all_of(
+          callees.begin(),
+          callees.end(),
+          [this] (auto &callee) { return trapFree_.count(callee) != 0; }
+      );
+      if (safe) {
+        ++it;
+      } else {
+        it = trapFree_.erase(it);
+        changed = true;
+      }
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::LowerFuncDecl(
+    const Scope &scope,
+    const FuncDecl &decl,
+    const std::vector<std::string> &captures)
 {
   // Emit the entry label of the function.
   auto it = funcs_.find(decl.GetName());
   assert(it != funcs_.end() && "missing function label");
-  EmitLabel(it->second);
+  EmitLabel(labelToAddress_.count(it->second) ? MakeLabel() : it->second);
 
   // Emit the function body.
   func_ = &decl;
+  nargs_ = decl.arg_size() + captures.size();
   assert(depth_ == 0 && "invalid stack depth in global scope");
+
+  // Returned self-recursive calls become jumps to the start of the body.
+  // If some of them are multiplied by a factor, the factors are multiplied
+  // into an accumulator, which is applied to the other returned values.
+  class TailCallFinder final : public AstVisitor<TailCallFinder> {
+  public:
+    TailCallFinder(const Codegen &codegen, const FuncDecl &decl)
+      : codegen_(codegen)
+      , decl_(decl)
+    {
+    }
+
+    bool VisitReturnStmt(const ReturnStmt &stmt)
+    {
+      const Expr *factor;
+      auto *call = MatchTailCall(stmt.GetExpr(), factor);
+      if (!call) {
+        return true;
+      }
+      if (auto *clone = codegen_.specs_.Find(*call)) {
+        if (clone != &decl_) {
+          return true;
+        }
+      } else {
+        auto &callee = call->GetCallee();
+        if (callee.GetKind() != Expr::Kind::REF) {
+          return true;
+        }
+        if (static_cast<const RefExpr &>(callee).GetName() != decl_.GetName()) {
+          return true;
+        }
+      }
+      HasCalls = true;
+      HasFactors = HasFactors || factor;
+      return true;
+    }
+
+    bool TraverseFuncExpr(const FuncExpr &)
+    {
+      // Returns from closures are lowered with their bodies.
+      return true;
+    }
+
+    bool HasCalls = false;
+    bool HasFactors = false;
+
+  private:
+    const Codegen &codegen_;
+    const FuncDecl &decl_;
+  };
+
+  // Functions which yield return a generator running their body. Calls to
+  // themselves create new generators, so they are never turned into jumps.
+  class YieldFinder final : public AstVisitor<YieldFinder> {
+  public:
+    bool VisitYieldStmt(const YieldStmt &) { return false; }
+
+    bool TraverseFuncExpr(const FuncExpr &)
+    {
+      // Closures which yield are generators of their own.
+      return true;
+    }
+  };
+
+  isGenerator_ = !YieldFinder().TraverseFuncDecl(decl);
+  if (isGenerator_) {
+    EmitGenCreate(nargs_);
+  }
+
+  TailCallFinder finder(*this, decl);
+  if (!isGenerator_) {
+    finder.TraverseFuncDecl(decl);
+  }
+  if (finder.HasFactors) {
+    EmitInt(1);
+    acc_ = depth_;
+  }
+  if (finder.HasCalls) {
+    loopHead_ = MakeLabel();
+    EmitLabel(*loopHead_);
+  }
+
   {
     std::map<std::string, uint32_t> args;
     for (auto it = decl.arg_begin(), end = decl.arg_end(); it != end; ++it) {
       args[it->first] = args.size();
     }
+    for (auto &name : captures) {
+      args[name] = args.size();
+    }
 
     FuncScope fnScope(&scope, args);
     LowerBlockStmt(fnScope, decl.GetBody());
   }
 
+  // All paths return, so the accumulator is never popped.
+  if (acc_) {
+    depth_ -= 1;
+  }
   assert(depth_ == 0 && "invalid stack depth on function exit");
   func_ = nullptr;
+  isGenerator_ = false;
+  loopHead_.reset();
+  acc_.reset();
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::LowerClosures(const Scope &scope)
+{
+  // Closures nested in the ones being emitted are appended to the queue.
+  for (size_t i = 0; i < pending_.size(); ++i) {
+    auto &expr = *pending_[i];
+    LowerFuncDecl(scope, expr.GetDecl(), closures_.Find(expr).Captures);
+  }
+  pending_.clear();
 }
 
 // -----------------------------------------------------------------------------
@@ -353,11 +1178,14 @@ void Codegen::Emit(const T &t)
 // -----------------------------------------------------------------------------
 void Codegen::EmitLabel(Label label)
 {
-  size_t address = code_.size();
-  for (auto loc : fixups_[label]) {
-    memcpy(code_.data() + loc, &address, sizeof(unsigned));
+  size_t address = base_ + code_.size();
+  if (auto it = fixups_.find(label); it != fixups_.end()) {
+    for (auto loc : it->second) {
+      memcpy(code_.data() + loc, &address, sizeof(size_t));
+    }
+    fixups_.erase(it);
   }
-  labelToAddress_.emplace(label, code_.size());
+  labelToAddress_.emplace(label, address);
 }
 
 // -----------------------------------------------------------------------------
@@ -379,34 +1207,102 @@ void Codegen::EmitPop()
   Emit<Opcode>(Opcode::POP);
 }
 
+// -----------------------------------------------------------------------------
+void Codegen::EmitPopN(unsigned n)
+{
+  assert(depth_ >= n && "not enough elements on stack");
+  switch (n) {
+    case 0: {
+      return;
+    }
+    case 1: {
+      return EmitPop();
+    }
+    default: {
+      depth_ -= n;
+      Emit<Opcode>(Opcode::POPN);
+      Emit<unsigned>(n);
+      return;
+    }
+  }
+}
+
 // -----------------------------------------------------------------------------
 void Codegen::EmitCall(unsigned nargs)
 {
   Emit<Opcode>(Opcode::CALL);
+  Emit<unsigned>(nargs);
 }
 
 
 // -----------------------------------------------------------------------------
-void Codegen::EmitPushFunc(Label entry)
+void Codegen::EmitPushFunc(Label entry, unsigned nargs)
 {
   depth_ += 1;
   Emit<Opcode>(Opcode::PUSH_FUNC);
   EmitFixup(entry);
+  Emit<unsigned>(nargs);
 }
 
 // -----------------------------------------------------------------------------
-void Codegen::EmitPushProto(RuntimeFn fn)
+void Codegen::EmitPushProto(RuntimeFn fn, unsigned nargs)
 {
   depth_ += 1;
   Emit<Opcode>(Opcode::PUSH_PROTO);
   Emit<RuntimeFn>(fn);
+  Emit<unsigned>(nargs);
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::EmitMakeClosure(unsigned n)
+{
+  assert(depth_ > n && "no elements on stack");
+  depth_ -= n;
+  Emit<Opcode>(Opcode::MAKE_CLOSURE);
+  Emit<unsigned>(n);
 }
 
 // -----------------------------------------------------------------------------
 void Codegen::EmitPeek(uint32_t index)
 {
   depth_ += 1;
-  Emit<Opcode>(Opcode::PEEK);
+  switch (index) {
+    case 0: {
+      Emit<Opcode>(Opcode::DUP);
+      return;
+    }
+    case 1: {
+      Emit<Opcode>(Opcode::OVER);
+      return;
+    }
+    default: {
+      Emit<Opcode>(Opcode::PEEK);
+      Emit<uint32_t>(index);
+      return;
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::EmitSwap()
+{
+  assert(depth_ >= 2 && "not enough elements on stack");
+  Emit<Opcode>(Opcode::SWAP);
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::EmitRot()
+{
+  assert(depth_ >= 3 && "not enough elements on stack");
+  Emit<Opcode>(Opcode::ROT);
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::EmitStore(uint32_t index)
+{
+  assert(depth_ > 0 && "no value to store");
+  depth_ -= 1;
+  Emit<Opcode>(Opcode::STORE);
   Emit<uint32_t>(index);
 }
 
@@ -424,7 +1320,37 @@ void Codegen::EmitReturn()
   depth_ -= 1;
   Emit<Opcode>(Opcode::RET);
   Emit<unsigned>(depth_);
-  Emit<unsigned>(func_ ? func_->arg_size() : 0);
+  Emit<unsigned>(func_ ? nargs_ : 0);
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::EmitGenCreate(unsigned nargs)
+{
+  Emit<Opcode>(Opcode::GEN_CREATE);
+  Emit<unsigned>(nargs);
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::EmitGenYield()
+{
+  assert(depth_ > 0 && "no elements on stack");
+  depth_ -= 1;
+  Emit<Opcode>(Opcode::GEN_YIELD);
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::EmitGenReturn()
+{
+  assert(depth_ > 0 && "no elements on stack");
+  depth_ -= 1;
+  Emit<Opcode>(Opcode::GEN_RETURN);
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::EmitLazy(size_t id)
+{
+  Emit<Opcode>(Opcode::LAZY);
+  Emit<size_t>(id);
 }
 
 // -----------------------------------------------------------------------------
@@ -443,6 +1369,22 @@ void Codegen::EmitSub()
   Emit<Opcode>(Opcode::SUB);
 }
 
+// -----------------------------------------------------------------------------
+void Codegen::EmitAddNoCheck()
+{
+  assert(depth_ > 0 && "no elements on stack");
+  depth_ -= 1;
+  Emit<Opcode>(Opcode::ADD_NOCHECK);
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::EmitSubNoCheck()
+{
+  assert(depth_ > 0 && "no elements on stack");
+  depth_ -= 1;
+  Emit<Opcode>(Opcode::SUB_NOCHECK);
+}
+
 // -----------------------------------------------------------------------------
 void Codegen::EmitMul()
 {
@@ -468,6 +1410,27 @@ void Codegen::EmitMod()
 }
 
 // -----------------------------------------------------------------------------
+void Codegen::EmitDivConst(int64_t d)
+{
+  assert(depth_ > 0 && "no elements on stack");
+  auto magic = DivMagic::For(d);
+  Emit<Opcode>(Opcode::DIV_CONST);
+  Emit<int64_t>(magic.Divisor);
+  Emit<int64_t>(magic.Multiplier);
+  Emit<uint32_t>(magic.Shift);
+}
+
+// -----------------------------------------------------------------------------
+void Codegen::EmitModConst(int64_t d)
+{
+  assert(depth_ > 0 && "no elements on stack");
+  auto magic = DivMagic::For(d);
+  Emit<Opcode>(Opcode::MOD_CONST);
+  Emit<int64_t>(magic.Divisor);
+  Emit<int64_t>(magic.Multiplier);
+  Emit<uint32_t>(magic.Shift);
+}
+
 // -----------------------------------------------------------------------------
 void Codegen::EmitGreater()
 {
@@ -506,8 +1469,6 @@ void Codegen::EmitIsEqual()
   depth_ -= 1;
   Emit<Opcode>(Opcode::IS_EQ);
 }
-// -----------------------------------------------------------------------------
-// -----------------------------------------------------------------------------
 
 // -----------------------------------------------------------------------------
 void Codegen::EmitJumpFalse(Label label)
@@ -4,11 +4,15 @@
 
 #include <memory>
 #include <optional>
+#include <set>
 #include <unordered_map>
 
 #include "program.h"
 #include "ast.h"
+#include "closure.h"
+#include "range.h"
 #include "runtime.h"
+#include "specialise.h"
 
 
 
@@ -17,9 +21,35 @@
  */
 class Codegen {
 public:
+  /// Options controlling the optimisations of the code generator.
+  struct Options {
+    /// Number of copies of the body emitted for small loops.
+    unsigned UnrollFactor = 4;
+    /// Maximal number of AST nodes in the condition and body of a loop
+    /// for it to be unrolled.
+    unsigned UnrollBudget = 24;
+    /// Limits on the functions cloned for constant arguments.
+    Specialiser::Options Clone;
+  };
+
+public:
+  /// Creates a code generator with the default options.
+  Codegen() : specs_(opts_.Clone) {}
+  /// Creates a code generator with a given set of options.
+  Codegen(const Options &opts) : opts_(opts), specs_(opts_.Clone) {}
+
   /// Entry point to the code generator: translated an entire module.
   std::unique_ptr<Program> Translate(const Module &mod);
 
+  /**
+   * Functions whose bodies were not parsed are translated to a stub which
+   * requests the function to be compiled when it is first executed. The
+   * stubs are identified by an index passed to the instruction.
+   */
+  const FuncDecl &GetLazyFunc(size_t id) const { return *lazy_[id]; }
+  /// Translates the body of a stubbed function, appending it to the program.
+  size_t TranslateLazy(size_t id, Program &prog);
+
 private:
   /// Descriptor for a label.
   struct Label {
@@ -39,13 +69,15 @@ private:
       FUNC,
       PROTO,
       ARG,
-      LOCAL
+      LOCAL,
+      CLOSURE
     } Kind;
 
     union {
       uint32_t Index;
       RuntimeFn Fn;
       Label Entry;
+      const FuncExpr *Closure;
     };
 
     Binding() {}
@@ -60,7 +92,7 @@ private:
 
     virtual Binding Lookup(const std::string &name) const = 0;
     virtual void AddLocal(const std::string &name, uint32_t pos) = 0;
-    virtual int NumberOfLocals() = 0;
+    virtual void AddClosure(const std::string &name, const FuncExpr *expr) = 0;
 
   protected:
     const Scope *parent_;
@@ -80,7 +112,7 @@ private:
 
     Binding Lookup(const std::string &name) const override;
     void AddLocal(const std::string &name, uint32_t pos){}
-    int NumberOfLocals(){return 0;}
+    void AddClosure(const std::string &name, const FuncExpr *expr){}
 
   private:
     const std::map<std::string, Label> &funcs_;
@@ -100,7 +132,7 @@ private:
 
     Binding Lookup(const std::string &name) const override;
     void AddLocal(const std::string &name, uint32_t pos){}
-    int NumberOfLocals(){return 0;}
+    void AddClosure(const std::string &name, const FuncExpr *expr){}
 
   private:
     const std::map<std::string, uint32_t> &args_;
@@ -113,18 +145,35 @@ private:
 
     Binding Lookup(const std::string &name) const override;
     void AddLocal(const std::string &name, uint32_t pos) {
-      locals_.insert(std::pair<std::string, uint32_t>(name, pos));
+      closures_.erase(name);
+      locals_.insert_or_assign(name, pos);
     }
-    int NumberOfLocals(){
-      return locals_.size();
+    /// Binds a name to a lifted closure, which has no slot.
+    void AddClosure(const std::string &name, const FuncExpr *expr) {
+      locals_.erase(name);
+      closures_.insert_or_assign(name, expr);
     }
 
+    /// Check whether a name is declared in this block.
+    bool HasLocal(const std::string &name) const {
+      return locals_.count(name) != 0;
+    }
+    /// Remove a local whose slot was released or reused.
+    void RemoveLocal(const std::string &name) {
+      locals_.erase(name);
+    }
+    /// Find the name of the local stored in a slot, if any.
+    const std::string *GetLocalAt(uint32_t pos) const;
 
   private:
     std::map<std::string, uint32_t> locals_;
+    std::map<std::string, const FuncExpr *> closures_;
   };
 
 private:
+  /// Orders the functions of the module and their clones for emission.
+  std::vector<const FuncDecl *> GetLayout(const Module &mod);
+
   /// Lowers a single statement.
   void LowerStmt(Scope &scope, const Stmt &stmt);
   /// Lowers a block statement.
@@ -135,10 +184,14 @@ private:
   void LowerIfStmt(Scope &scope, const IfStmt &ifStmt);
   /// Lowers a return statement.
   void LowerReturnStmt(const Scope &scope, const ReturnStmt &returnStmt);
+  /// Lowers a yield statement.
+  void LowerYieldStmt(const Scope &scope, const YieldStmt &yieldStmt);
   /// Lowers a standalone expression statement.
   void LowerExprStmt(const Scope &scope, const ExprStmt &exprStmt);
   /// Lowers a let statement.
   void LowerLetStmt(Scope &scope, const LetStmt &letStmt);
+  /// Lowers an assignment.
+  void LowerAssignStmt(const Scope &scope, const AssignStmt &assignStmt);
 
   /// Lowers a single expression.
   void LowerExpr(const Scope &scope, const Expr &expr);
@@ -148,11 +201,44 @@ private:
   void LowerBinaryExpr(const Scope &scope, const BinaryExpr &expr);
   /// Lowers a call expression.
   void LowerCallExpr(const Scope &scope, const CallExpr &expr);
+  /// Returns the arguments passed by a call, in the order they are pushed.
+  std::vector<const Expr *> GetCallArgs(const CallExpr &call);
+  /// Lowers a returned self-recursive call to a jump, if possible.
+  bool LowerTailCall(const Scope &scope, const Expr &expr);
+  /// Check whether a call invokes the function being compiled.
+  bool IsSelfCall(const Scope &scope, const CallExpr &call);
+  /// Check whether a factor can be accumulated before the call it multiplies.
+  bool IsSafeFactor(const Scope &scope, const Expr &expr);
+  /// Takes over operands which are already on top of the stack.
+  bool LowerInPlace(const Scope &scope, const std::vector<const Expr *> &exprs);
   /// Lowers a call expression
   void LowerIntExpr(const Scope &scope, const IntExpr &number);
-
-  /// Lowers a function declaration.
-  void LowerFuncDecl(const Scope &scope, const FuncDecl &funcDecl);
+  /// Lowers a function expression, creating a closure.
+  void LowerFuncExpr(const Scope &scope, const FuncExpr &expr);
+  /// Pushes the value of a variable captured by a closure.
+  void LowerCapture(const Scope &scope, const std::string &name);
+  /// Returns the entry label of a closure, queueing its body for emission.
+  Label GetClosureLabel(const FuncExpr &expr);
+
+  /// Lowers a function declaration. Captures are extra arguments of closures.
+  void LowerFuncDecl(
+      const Scope &scope,
+      const FuncDecl &funcDecl,
+      const std::vector<std::string> &captures = {});
+  /// Lowers the bodies of the closures created by the code emitted so far.
+  void LowerClosures(const Scope &scope);
+
+  /// Counts the AST nodes of a statement, estimating the size of its code.
+  static unsigned CountNodes(const Stmt &stmt);
+  /// Counts the AST nodes of an expression.
+  static unsigned CountNodes(const Expr &expr);
+
+  /// Check whether an expression can be dropped if its value is unused.
+  bool IsRemovable(const Scope &scope, const Expr &expr);
+  /// Check whether an arithmetic operation cannot raise an error.
+  bool IsTrapFree(const BinaryExpr &binary) const;
+  /// Find the pure functions and prototypes whose calls cannot fail.
+  void FindTrapFree(const Module &mod);
 
 private:
   /// Create a new label.
@@ -160,28 +246,54 @@ private:
 
   /// Emit a pop instruction.
   void EmitPop();
+  /// Emit instructions to pop n values.
+  void EmitPopN(unsigned n);
   /// Emit a call instruction.
   void EmitCall(unsigned nargs);
-  /// Push a function address to the stack.
-  void EmitPushFunc(Label entry);
-  /// Push a prototype to the stack.
-  void EmitPushProto(RuntimeFn fn);
+  /// Push a function address to the stack, along with its argument count.
+  void EmitPushFunc(Label entry, unsigned nargs);
+  /// Push a prototype to the stack, along with its argument count.
+  void EmitPushProto(RuntimeFn fn, unsigned nargs);
+  /// Wrap a function address and n captured values into a closure.
+  void EmitMakeClosure(unsigned n);
   /// Push the nth value from the stack to the top.
   void EmitPeek(uint32_t index);
+  /// Exchange the two values on top of the stack.
+  void EmitSwap();
+  /// Move the third value from the top of the stack to the top.
+  void EmitRot();
+  /// Pop a value into the nth slot of the remaining stack.
+  void EmitStore(uint32_t index);
   ///
   void EmitInt(uint64_t n);
   /// Emit a return instruction.
   void EmitReturn();
+  /// Emit the creation of a generator on entry to a function.
+  void EmitGenCreate(unsigned nargs);
+  /// Emit a yield from a generator.
+  void EmitGenYield();
+  /// Emit a return from a generator.
+  void EmitGenReturn();
+  /// Emit a stub compiling a function on demand.
+  void EmitLazy(size_t id);
   /// Emit an add opcode.
   void EmitAdd();
   /// Emit a sub opcode.
   void EmitSub();
+  /// Emit an add opcode without an overflow check.
+  void EmitAddNoCheck();
+  /// Emit a sub opcode without an overflow check.
+  void EmitSubNoCheck();
   /// Emit a mul opcode.
   void EmitMul();
   /// Emit a div opcode.
   void EmitDiv();
   /// Emit a mod opcode.
   void EmitMod();
+  /// Emit a division by a constant, using a multiplication.
+  void EmitDivConst(int64_t d);
+  /// Emit a modulo by a constant, using a multiplication.
+  void EmitModConst(int64_t d);
 
 
   /// Emit an greater opcode.
@@ -209,12 +321,28 @@ private:
   void EmitFixup(Label label);
 
 private:
+  /// Optimisation options.
+  Options opts_;
   /// Reference to the program constructed by the code generator.
   std::vector<uint8_t> code_;
+  /// Address of the start of code_ in the program.
+  size_t base_ = 0;
   /// Current stack depth.
   unsigned depth_ = 0;
   /// Current function being compiled.
-  const FuncDecl *func_;
+  const FuncDecl *func_ = nullptr;
+  /// Number of arguments of the current function, including captures.
+  unsigned nargs_ = 0;
+  /// True if the current function yields, running as a generator.
+  bool isGenerator_ = false;
+  /// Start of the body of the current function, if tail calls jump to it.
+  std::optional<Label> loopHead_;
+  /// Slot accumulating the factors of self-recursive calls.
+  std::optional<uint32_t> acc_;
+  /// Locals of the current block whose last use is in the current statement.
+  std::set<std::string> movable_;
+  /// Locals whose value was moved out of their slot by the statement.
+  std::set<std::string> moved_;
   /// Identifier of the next label.
   unsigned nextLabel_ = 0;
 
@@ -227,4 +355,26 @@ private:
   std::unordered_map<Label, unsigned, LabelHash> labelToAddress_;
   /// Mapping from functions to their entry labels.
   std::map<std::string, Label> funcs_;
+  /// Mapping from prototypes to runtime methods.
+  std::map<std::string, RuntimeFn> protos_;
+  /// Number of arguments of functions and prototypes, including captures.
+  std::map<std::string, unsigned> arities_;
+  /// Functions to be compiled on demand.
+  std::vector<const FuncDecl *> lazy_;
+  /// Functions and prototypes without side effects.
+  std::set<std::string> pure_;
+  /// Pure functions and prototypes whose calls cannot raise errors.
+  std::set<std::string> trapFree_;
+  /// Ranges of integer expressions, used to elide overflow checks.
+  RangeAnalysis ranges_;
+  /// Clones of functions specialised for constant arguments.
+  Specialiser specs_;
+  /// Products of induction variables replaced by the slots holding them.
+  std::unordered_map<const BinaryExpr *, std::string> derived_;
+  /// Slots to be advanced, along with their step, after an assignment.
+  std::unordered_map<const AssignStmt *, std::vector<std::pair<std::string, int64_t>>> updates_;
+  /// Captures of closures and the ones which can be lifted.
+  ClosureAnalysis closures_;
+  /// Closures whose bodies remain to be emitted.
+  std::vector<const FuncExpr *> pending_;
 };
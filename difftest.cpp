@@ -0,0 +1,738 @@
+// This file is part of the IMP project.
+
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <regex>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "ast.h"
+#include "lexer.h"
+#include "parser.h"
+
+
+
+/**
+ * Options passed to the interpreter by each configuration. The first one is
+ * the reference which the output of the others is compared to.
+ *
+ * Batch mode and replays are not covered, as they format the output of runs
+ * differently. Recording goes through the same path as replays, intercepting
+ * the calls to runtime methods.
+ */
+static const std::vector<std::vector<std::string>> kConfigs = {
+  { },
+  { "--unroll=1", "--clone=0" },
+  { "--unroll=8", "--clone=16" },
+  { "--lazy" },
+  { "--lazy", "--unroll=1", "--clone=0" },
+  { "--record=/dev/null" },
+  { "--read-ahead" },
+};
+
+/**
+ * Outcome of the run of a program under a configuration.
+ */
+struct Outcome {
+  /// Data written to stdout.
+  std::string Out;
+  /// Data written to stderr.
+  std::string Err;
+  /// Exit status, or the negated number of the signal killing the process.
+  int Status;
+  /// Set if the run was stopped after the time limit.
+  bool TimedOut;
+};
+
+/**
+ * Runs programs under all configurations in a scratch directory.
+ */
+class Runner {
+public:
+  Runner(const std::string &imp, const char *input, unsigned timeout)
+    : imp_(imp)
+    , input_(input)
+    , timeout_(timeout)
+  {
+    char dir[] = "/tmp/imp-difftest-XXXXXX";
+    if (!mkdtemp(dir)) {
+      throw std::runtime_error("cannot create scratch directory");
+    }
+    dir_ = dir;
+  }
+
+  ~Runner()
+  {
+    unlink((dir_ + "/prog.imp").c_str());
+    for (size_t i = 0; i < kConfigs.size(); ++i) {
+      unlink(GetPath("stdout", i).c_str());
+      unlink(GetPath("stderr", i).c_str());
+    }
+    rmdir(dir_.c_str());
+  }
+
+  /// Runs a program under all configurations, which are run concurrently.
+  std::vector<Outcome> RunAll(const std::string &source)
+  {
+    auto path = dir_ + "/prog.imp";
+    std::ofstream(path) << source;
+    std::vector<pid_t> pids;
+    for (size_t i = 0; i < kConfigs.size(); ++i) {
+      pids.push_back(Start(path, i));
+    }
+
+    // Poll the children until they exit, killing them past the time limit.
+    std::vector<Outcome> outcomes(kConfigs.size(), Outcome{ "", "", 0, false });
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_);
+    for (size_t i = 0; i < kConfigs.size(); ++i) {
+      auto &outcome = outcomes[i];
+      int status;
+      while (waitpid(pids[i], &status, WNOHANG) == 0) {
+        if (std::chrono::steady_clock::now() > deadline) {
+          kill(pids[i], SIGKILL);
+          waitpid(pids[i], &status, 0);
+          outcome.TimedOut = true;
+          break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      outcome.Status = WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status);
+      outcome.Out = ReadFile(GetPath("stdout", i));
+
+      // Bytecode addresses depend on the layout chosen by the configuration.
+      static const std::regex kAddr(R"(\[bytecode:[0-9]+\])");
+      outcome.Err = std::regex_replace(ReadFile(GetPath("stderr", i)), kAddr, "[bytecode]");
+    }
+    return outcomes;
+  }
+
+private:
+  /// Starts the interpreter on a program under a configuration.
+  pid_t Start(const std::string &path, size_t config)
+  {
+    auto out = GetPath("stdout", config);
+    auto err = GetPath("stderr", config);
+
+    std::vector<const char *> argv{ imp_.c_str() };
+    for (auto &opt : kConfigs[config]) {
+      argv.push_back(opt.c_str());
+    }
+    argv.push_back(path.c_str());
+    argv.push_back(nullptr);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+      throw std::runtime_error("cannot fork");
+    }
+    if (pid == 0) {
+      // Redirect the streams of the child, which is always fed the same input.
+      int in = open(input_ ? input_ : "/dev/null", O_RDONLY);
+      int fdOut = open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      int fdErr = open(err.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (in < 0 || fdOut < 0 || fdErr < 0) {
+        _exit(127);
+      }
+      dup2(in, STDIN_FILENO);
+      dup2(fdOut, STDOUT_FILENO);
+      dup2(fdErr, STDERR_FILENO);
+      execv(imp_.c_str(), const_cast<char *const *>(argv.data()));
+      _exit(127);
+    }
+    return pid;
+  }
+
+  /// Returns the path to an output file of a configuration.
+  std::string GetPath(const char *name, size_t config) const
+  {
+    return dir_ + "/" + name + "." + std::to_string(config);
+  }
+
+  /// Reads the contents of a file.
+  static std::string ReadFile(const std::string &path)
+  {
+    std::ifstream is(path);
+    std::ostringstream os;
+    os << is.rdbuf();
+    return os.str();
+  }
+
+private:
+  /// Path to the interpreter.
+  std::string imp_;
+  /// Path to the input of the programs, if any.
+  const char *input_;
+  /// Time limit of a run, in milliseconds.
+  unsigned timeout_;
+  /// Scratch directory holding the program and its output.
+  std::string dir_;
+};
+
+/**
+ * Prints a module back to source, optionally applying an edit to one of
+ * its statements or expressions.
+ *
+ * Statements and expressions are numbered in the order they are printed,
+ * counting occurrences: as subexpressions are shared, a node can occur at
+ * multiple places, which are edited separately. Parentheses are never
+ * needed, as replacing an operation with one of its operands cannot break
+ * the precedence or the associativity of the enclosing operation.
+ */
+class Printer {
+public:
+  /// Transformations applied by the reducer.
+  enum class Edit {
+    /// Delete a statement or a top-level declaration.
+    DROP,
+    /// Replace a conditional or a loop with its body.
+    HOIST,
+    /// Replace an expression with zero.
+    ZERO,
+    /// Replace an operation with its left operand.
+    LHS,
+    /// Replace an operation with its right operand.
+    RHS,
+  };
+
+public:
+  /// Prints a module, applying an edit to the n-th statement or expression.
+  Printer(Edit edit, unsigned target)
+    : edit_(edit)
+    , target_(target)
+  {
+  }
+
+  /// Returns the source of the module.
+  std::string Print(const Module &module)
+  {
+    for (auto &item : module) {
+      if (auto *func = std::get_if<std::shared_ptr<FuncDecl>>(&item)) {
+        if (IsTarget(true) && edit_ == Edit::DROP) {
+          applied_ = true;
+          continue;
+        }
+        PrintDecl(**func);
+        PrintBlock((*func)->GetBody(), 0);
+      } else if (auto *proto = std::get_if<std::shared_ptr<ProtoDecl>>(&item)) {
+        // Prototypes are kept, as the runtime methods are always available.
+        PrintDecl(**proto);
+        os_ << " = \"" << (*proto)->GetPrimitiveName() << "\"";
+      } else {
+        auto text = Nested(*std::get<std::shared_ptr<Stmt>>(item), 0);
+        if (text.empty()) {
+          continue;
+        }
+        os_ << text;
+      }
+      os_ << "\n";
+    }
+    return os_.str();
+  }
+
+  /// Checks whether the edit was applied.
+  bool IsApplied() const { return applied_; }
+  /// Returns the number of statements or expressions which can be edited.
+  unsigned GetSites() const { return IsStmtEdit() ? stmts_ : exprs_; }
+
+private:
+  /// Checks whether the edit applies to statements.
+  bool IsStmtEdit() const { return edit_ == Edit::DROP || edit_ == Edit::HOIST; }
+
+  /// Numbers a statement or an expression, checking if it is the target.
+  bool IsTarget(bool stmt)
+  {
+    if (stmt) {
+      return IsStmtEdit() && stmts_++ == target_;
+    } else {
+      return !IsStmtEdit() && exprs_++ == target_;
+    }
+  }
+
+  /// Prints the signature of a declaration.
+  void PrintDecl(const FuncOrProtoDecl &decl)
+  {
+    static const std::pair<FuncOrProtoDecl::Attr, const char *> kAttrs[] = {
+      { FuncOrProtoDecl::Attr::PURE, "@pure" },
+      { FuncOrProtoDecl::Attr::NOINLINE, "@noinline" },
+      { FuncOrProtoDecl::Attr::HOT, "@hot" },
+      { FuncOrProtoDecl::Attr::COLD, "@cold" },
+    };
+    for (auto &[attr, name] : kAttrs) {
+      if (decl.HasAttr(attr)) {
+        os_ << name << " ";
+      }
+    }
+    os_ << "func " << decl.GetName();
+    PrintSignature(decl);
+  }
+
+  /// Prints the arguments and the return type of a function.
+  void PrintSignature(const FuncOrProtoDecl &decl)
+  {
+    os_ << "(";
+    for (auto it = decl.arg_begin(); it != decl.arg_end(); ++it) {
+      os_ << (it == decl.arg_begin() ? "" : ", ") << it->first << ": " << it->second;
+    }
+    os_ << "): " << decl.GetType();
+  }
+
+  /// Prints a block, with its statements indented.
+  void PrintBlock(const BlockStmt &block, unsigned indent)
+  {
+    os_ << " {";
+    bool first = true;
+    for (auto &stmt : block) {
+      // Deleted statements leave no trace, so the separator comes first.
+      auto text = Nested(*stmt, indent + 2);
+      if (!text.empty()) {
+        os_ << (first ? "\n" : ";\n") << std::string(indent + 2, ' ') << text;
+        first = false;
+      }
+    }
+    os_ << (first ? "" : "\n" + std::string(indent, ' ')) << "}";
+  }
+
+  /// Prints a statement nested in another, which cannot be deleted.
+  void PrintBody(const Stmt &stmt, unsigned indent)
+  {
+    auto text = Nested(stmt, indent);
+    os_ << " " << (text.empty() ? "{}" : text);
+  }
+
+  /// Prints a statement to a separate string, empty if it is deleted.
+  std::string Nested(const Stmt &stmt, unsigned indent)
+  {
+    std::ostringstream os;
+    std::swap(os, os_);
+    PrintStmt(stmt, indent);
+    std::swap(os, os_);
+    return os.str();
+  }
+
+  /// Prints a statement, unless it is deleted.
+  void PrintStmt(const Stmt &stmt, unsigned indent)
+  {
+    if (IsTarget(true)) {
+      switch (edit_) {
+        case Edit::DROP: {
+          applied_ = true;
+          return;
+        }
+        case Edit::HOIST: {
+          if (stmt.GetKind() == Stmt::Kind::WHILE) {
+            applied_ = true;
+            PrintStmt(static_cast<const WhileStmt &>(stmt).GetStmt(), indent);
+            return;
+          }
+          if (stmt.GetKind() == Stmt::Kind::IF) {
+            applied_ = true;
+            PrintStmt(static_cast<const IfStmt &>(stmt).GetStmt(), indent);
+            return;
+          }
+          break;
+        }
+        default: {
+          break;
+        }
+      }
+    }
+
+    switch (stmt.GetKind()) {
+      case Stmt::Kind::BLOCK: {
+        // Blocks are printed with a leading space for use after keywords.
+        std::ostringstream os;
+        std::swap(os, os_);
+        PrintBlock(static_cast<const BlockStmt &>(stmt), indent);
+        std::swap(os, os_);
+        os_ << os.str().substr(1);
+        return;
+      }
+      case Stmt::Kind::WHILE: {
+        auto &whileStmt = static_cast<const WhileStmt &>(stmt);
+        os_ << "while (";
+        PrintExpr(whileStmt.GetCond());
+        os_ << ")";
+        PrintBody(whileStmt.GetStmt(), indent);
+        return;
+      }
+      case Stmt::Kind::IF: {
+        auto &ifStmt = static_cast<const IfStmt &>(stmt);
+        os_ << "if (";
+        PrintExpr(ifStmt.GetCond());
+        os_ << ")";
+        PrintBody(ifStmt.GetStmt(), indent);
+        if (auto elseStmt = ifStmt.GetElseStmt()) {
+          auto text = Nested(*elseStmt, indent);
+          if (!text.empty()) {
+            os_ << " else " << text;
+          }
+        }
+        return;
+      }
+      case Stmt::Kind::LET: {
+        auto &let = static_cast<const LetStmt &>(stmt);
+        os_ << "let " << let.GetName() << ": " << let.GetType();
+        if (auto init = let.GetInitialisation()) {
+          os_ << " = ";
+          PrintExpr(*init);
+        }
+        return;
+      }
+      case Stmt::Kind::ASSIGN: {
+        auto &assign = static_cast<const AssignStmt &>(stmt);
+        os_ << assign.GetName() << " = ";
+        PrintExpr(assign.GetExpr());
+        return;
+      }
+      case Stmt::Kind::EXPR: {
+        PrintExpr(static_cast<const ExprStmt &>(stmt).GetExpr());
+        return;
+      }
+      case Stmt::Kind::RETURN: {
+        os_ << "return ";
+        PrintExpr(static_cast<const ReturnStmt &>(stmt).GetExpr());
+        return;
+      }
+      case Stmt::Kind::YIELD: {
+        os_ << "yield ";
+        PrintExpr(static_cast<const YieldStmt &>(stmt).GetExpr());
+        return;
+      }
+    }
+  }
+
+  /// Prints an expression, or its replacement.
+  void PrintExpr(const Expr &expr)
+  {
+    if (IsTarget(false)) {
+      switch (edit_) {
+        case Edit::ZERO: {
+          if (expr.GetKind() != Expr::Kind::INT) {
+            applied_ = true;
+            os_ << "0";
+            return;
+          }
+          break;
+        }
+        case Edit::LHS:
+        case Edit::RHS: {
+          if (expr.GetKind() == Expr::Kind::BINARY) {
+            auto &binary = static_cast<const BinaryExpr &>(expr);
+            applied_ = true;
+            PrintExpr(edit_ == Edit::LHS ? binary.GetLHS() : binary.GetRHS());
+            return;
+          }
+          break;
+        }
+        default: {
+          break;
+        }
+      }
+    }
+
+    switch (expr.GetKind()) {
+      case Expr::Kind::REF: {
+        os_ << static_cast<const RefExpr &>(expr).GetName();
+        return;
+      }
+      case Expr::Kind::INT: {
+        os_ << static_cast<const IntExpr &>(expr).GetNumber();
+        return;
+      }
+      case Expr::Kind::BINARY: {
+        auto &binary = static_cast<const BinaryExpr &>(expr);
+        PrintExpr(binary.GetLHS());
+        switch (binary.GetKind()) {
+          case BinaryExpr::Kind::ADD: os_ << " + "; break;
+          case BinaryExpr::Kind::SUB: os_ << " - "; break;
+          case BinaryExpr::Kind::MUL: os_ << " * "; break;
+          case BinaryExpr::Kind::DIV: os_ << " / "; break;
+          case BinaryExpr::Kind::MOD: os_ << " % "; break;
+          case BinaryExpr::Kind::GREATER: os_ << " > "; break;
+          case BinaryExpr::Kind::LOWER: os_ << " < "; break;
+          case BinaryExpr::Kind::GREATER_EQ: os_ << " >= "; break;
+          case BinaryExpr::Kind::LOWER_EQ: os_ << " <= "; break;
+          case BinaryExpr::Kind::IS_EQ: os_ << " == "; break;
+        }
+        PrintExpr(binary.GetRHS());
+        return;
+      }
+      case Expr::Kind::CALL: {
+        // Callees are not edited, as calls to other values are invalid.
+        auto &call = static_cast<const CallExpr &>(expr);
+        auto &callee = call.GetCallee();
+        if (callee.GetKind() == Expr::Kind::REF) {
+          os_ << static_cast<const RefExpr &>(callee).GetName();
+        } else {
+          PrintExpr(callee);
+        }
+        std::vector<const Expr *> args;
+        for (auto it = call.arg_rbegin(); it != call.arg_rend(); ++it) {
+          args.insert(args.begin(), it->get());
+        }
+        os_ << "(";
+        for (size_t i = 0; i < args.size(); ++i) {
+          os_ << (i ? ", " : "");
+          PrintExpr(*args[i]);
+        }
+        os_ << ")";
+        return;
+      }
+      case Expr::Kind::FUNC: {
+        auto &decl = static_cast<const FuncExpr &>(expr).GetDecl();
+        os_ << "func";
+        PrintSignature(decl);
+        PrintBlock(decl.GetBody(), 0);
+        return;
+      }
+    }
+  }
+
+private:
+  /// Edit to apply.
+  Edit edit_;
+  /// Index of the statement or expression to edit.
+  unsigned target_;
+  /// Number of statements printed so far.
+  unsigned stmts_ = 0;
+  /// Number of expressions printed so far.
+  unsigned exprs_ = 0;
+  /// Set once the edit was applied.
+  bool applied_ = false;
+  /// Stream receiving the source.
+  std::ostringstream os_;
+};
+
+// -----------------------------------------------------------------------------
+static std::shared_ptr<Module> Parse(const std::string &source)
+{
+  Lexer lexer("<difftest>", std::string(source));
+  lexer.Tokenize(1);
+  return Parser(lexer, false).ParseModule();
+}
+
+// -----------------------------------------------------------------------------
+/// Returns the set of configurations disagreeing with the reference, or
+/// nothing if any of the runs timed out.
+static std::optional<std::set<size_t>> Compare(const std::vector<Outcome> &outcomes)
+{
+  std::set<size_t> diffs;
+  auto &ref = outcomes[0];
+  for (size_t i = 0; i < outcomes.size(); ++i) {
+    auto &outcome = outcomes[i];
+    if (outcome.TimedOut) {
+      return std::nullopt;
+    }
+    if (outcome.Out != ref.Out || outcome.Err != ref.Err || outcome.Status != ref.Status) {
+      diffs.insert(i);
+    }
+  }
+  return diffs;
+}
+
+// -----------------------------------------------------------------------------
+/// Minimises a program while the same configurations disagree with the
+/// reference, which must exit with the same status.
+static std::string Reduce(Runner &runner, const std::string &source, const std::vector<Outcome> &outcomes)
+{
+  auto diffs = Compare(outcomes);
+  auto status = outcomes[0].Status;
+  auto interesting = [&] (const std::string &candidate) {
+    auto runs = runner.RunAll(candidate);
+    return runs[0].Status == status && Compare(runs) == diffs;
+  };
+
+  // Start from the printed form of the program, which drops the comments.
+  std::string current = Printer(Printer::Edit::DROP, ~0u).Print(*Parse(source));
+  if (!interesting(current)) {
+    return source;
+  }
+
+  // Greedily apply edits until none of them preserves the disagreement.
+  // An edit which is accepted shifts the numbering of the following sites,
+  // so the same index is tried again on the new program.
+  static const Printer::Edit kEdits[] = {
+    Printer::Edit::DROP,
+    Printer::Edit::HOIST,
+    Printer::Edit::ZERO,
+    Printer::Edit::LHS,
+    Printer::Edit::RHS,
+  };
+  for (bool progress = true; progress; ) {
+    progress = false;
+    for (auto edit : kEdits) {
+      auto module = Parse(current);
+      for (unsigned k = 0; ; ++k) {
+        Printer printer(edit, k);
+        auto candidate = printer.Print(*module);
+        if (k >= printer.GetSites()) {
+          break;
+        }
+        if (!printer.IsApplied() || candidate == current) {
+          continue;
+        }
+        if (interesting(candidate)) {
+          current = candidate;
+          module = Parse(current);
+          progress = true;
+          --k;
+        }
+      }
+    }
+  }
+  return current;
+}
+
+// -----------------------------------------------------------------------------
+static std::string FormatConfig(const std::vector<std::string> &config)
+{
+  if (config.empty()) {
+    return "default";
+  }
+  std::string s;
+  for (auto &opt : config) {
+    s += (s.empty() ? "" : " ") + opt;
+  }
+  return s;
+}
+
+// -----------------------------------------------------------------------------
+static int Usage(const char *exeName)
+{
+  std::cerr << "Usage: " << exeName << " [options] path-to-file..." << std::endl;
+  std::cerr << "Options:" << std::endl;
+  std::cerr << "  --imp=PATH            path to the interpreter (next to this tool by default)" << std::endl;
+  std::cerr << "  --input=FILE          read the input of the programs from FILE" << std::endl;
+  std::cerr << "  --timeout=MS          time limit of each run, in milliseconds" << std::endl;
+  std::cerr << "  --reduce              minimise the programs whose runs disagree" << std::endl;
+  return EXIT_FAILURE;
+}
+
+// -----------------------------------------------------------------------------
+int main(int argc, char **argv)
+{
+  const char *exeName = argc < 1 ? "imp-difftest" : argv[0];
+
+  // Parse the command-line options.
+  std::string imp;
+  const char *input = nullptr;
+  unsigned timeout = 5000;
+  bool reduce = false;
+  std::vector<const char *> paths;
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg(argv[i]);
+    if (arg.substr(0, 6) == "--imp=") {
+      imp = argv[i] + 6;
+      continue;
+    }
+    if (arg.substr(0, 8) == "--input=") {
+      input = argv[i] + 8;
+      continue;
+    }
+    if (arg.substr(0, 10) == "--timeout=") {
+      timeout = std::atoi(argv[i] + 10);
+      if (timeout == 0) {
+        return Usage(exeName);
+      }
+      continue;
+    }
+    if (arg == "--reduce") {
+      reduce = true;
+      continue;
+    }
+    if (arg.size() > 1 && arg[0] == '-') {
+      return Usage(exeName);
+    }
+    paths.push_back(argv[i]);
+  }
+  if (paths.empty()) {
+    return Usage(exeName);
+  }
+  if (imp.empty()) {
+    std::string_view exe(exeName);
+    auto slash = exe.rfind('/');
+    imp = slash == std::string_view::npos ? "./imp" : std::string(exe.substr(0, slash + 1)) + "imp";
+  }
+  if (access(imp.c_str(), X_OK) != 0) {
+    std::cerr << "cannot execute interpreter " << imp << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  try {
+    Runner runner(imp, input, timeout);
+    int status = EXIT_SUCCESS;
+    for (auto *path : paths) {
+      std::ifstream is(path);
+      if (!is) {
+        std::cerr << path << ": cannot open file" << std::endl;
+        status = EXIT_FAILURE;
+        continue;
+      }
+      std::ostringstream os;
+      os << is.rdbuf();
+      auto source = os.str();
+
+      // Run the program under all configurations, reporting the ones
+      // whose output or exit status differs from the reference.
+      auto outcomes = runner.RunAll(source);
+      if (outcomes[0].TimedOut) {
+        std::cout << path << ": timed out" << std::endl;
+        status = EXIT_FAILURE;
+        continue;
+      }
+      auto &ref = outcomes[0];
+      bool ok = true;
+      for (size_t i = 1; i < outcomes.size(); ++i) {
+        auto &outcome = outcomes[i];
+        auto config = FormatConfig(kConfigs[i]);
+        if (outcome.TimedOut) {
+          std::cout << path << ": " << config << ": timed out" << std::endl;
+          ok = false;
+          continue;
+        }
+        if (outcome.Out != ref.Out) {
+          std::cout << path << ": " << config << ": stdout differs" << std::endl;
+          ok = false;
+        }
+        if (outcome.Err != ref.Err) {
+          std::cout << path << ": " << config << ": stderr differs" << std::endl;
+          ok = false;
+        }
+        if (outcome.Status != ref.Status) {
+          std::cout << path << ": " << config << ": exit status " << outcome.Status
+                    << " instead of " << ref.Status << std::endl;
+          ok = false;
+        }
+      }
+      if (ok) {
+        std::cout << path << ": ok" << std::endl;
+        continue;
+      }
+      status = EXIT_FAILURE;
+
+      // Print the smallest program found which exhibits the same mismatch.
+      if (reduce && Compare(outcomes)) {
+        std::cout << path << ": reduced program:" << std::endl;
+        std::cout << Reduce(runner, source, outcomes);
+      }
+    }
+    return status;
+  } catch (const std::exception &ex) {
+    std::cerr << ex.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+}
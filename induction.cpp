@@ -0,0 +1,157 @@
+// This file is part of the IMP project.
+
+#include <map>
+#include <set>
+
+#include "induction.h"
+#include "visitor.h"
+
+
+
+/**
+ * Collects the assignments, declarations and products with constants
+ * of a loop.
+ */
+class LoopScanner final : public AstVisitor<LoopScanner> {
+public:
+  bool VisitAssignStmt(const AssignStmt &stmt)
+  {
+    Assigns[stmt.GetName()]++;
+    return true;
+  }
+
+  bool VisitLetStmt(const LetStmt &stmt)
+  {
+    Locals.insert(stmt.GetName());
+    return true;
+  }
+
+  bool TraverseFuncExpr(const FuncExpr &)
+  {
+    // Closures cannot assign captured variables and are lowered separately.
+    return true;
+  }
+
+  bool VisitBinaryExpr(const BinaryExpr &expr)
+  {
+    if (expr.GetKind() == BinaryExpr::Kind::MUL) {
+      auto lhs = expr.GetLHS().GetKind();
+      auto rhs = expr.GetRHS().GetKind();
+      if ((lhs == Expr::Kind::REF && rhs == Expr::Kind::INT) ||
+          (lhs == Expr::Kind::INT && rhs == Expr::Kind::REF))
+      {
+        if (Seen.insert(&expr).second) {
+          Products.push_back(&expr);
+        }
+      }
+    }
+    return true;
+  }
+
+  /// Number of assignments to each name.
+  std::map<std::string, unsigned> Assigns;
+  /// Names declared in the loop.
+  std::set<std::string> Locals;
+  /// Products of a name and a constant, in the order they were found.
+  std::vector<const BinaryExpr *> Products;
+  /// Set of products, as nodes can be shared.
+  std::set<const BinaryExpr *> Seen;
+};
+
+// -----------------------------------------------------------------------------
+/// Splits a product or a sum of a name and a constant into its operands.
+static std::pair<const RefExpr *, uint64_t> Split(const BinaryExpr &expr)
+{
+  auto *lhs = &expr.GetLHS();
+  auto *rhs = &expr.GetRHS();
+  if (lhs->GetKind() == Expr::Kind::INT) {
+    std::swap(lhs, rhs);
+  }
+  if (lhs->GetKind() != Expr::Kind::REF || rhs->GetKind() != Expr::Kind::INT) {
+    return { nullptr, 0 };
+  }
+  return {
+    static_cast<const RefExpr *>(lhs),
+    static_cast<const IntExpr *>(rhs)->GetNumber()
+  };
+}
+
+// -----------------------------------------------------------------------------
+InductionAnalysis::InductionAnalysis(const WhileStmt &loop)
+{
+  LoopScanner scan;
+  scan.TraverseExpr(loop.GetCond());
+  scan.TraverseStmt(loop.GetStmt());
+  if (scan.Products.empty()) {
+    return;
+  }
+
+  // Find the basic induction variables among the statements of the body.
+  std::vector<const Stmt *> stmts;
+  auto &body = loop.GetStmt();
+  if (body.GetKind() == Stmt::Kind::BLOCK) {
+    for (auto &stmt : static_cast<const BlockStmt &>(body)) {
+      stmts.push_back(stmt.get());
+    }
+  } else {
+    stmts.push_back(&body);
+  }
+
+  std::map<std::string, std::pair<const AssignStmt *, uint64_t>> basic;
+  for (auto *stmt : stmts) {
+    if (stmt->GetKind() != Stmt::Kind::ASSIGN) {
+      continue;
+    }
+    auto &assign = static_cast<const AssignStmt &>(*stmt);
+    auto &name = assign.GetName();
+    if (scan.Assigns[name] != 1 || scan.Locals.count(name)) {
+      continue;
+    }
+    if (assign.GetExpr().GetKind() != Expr::Kind::BINARY) {
+      continue;
+    }
+    auto &value = static_cast<const BinaryExpr &>(assign.GetExpr());
+    auto [ref, c] = Split(value);
+    if (!ref || ref->GetName() != name) {
+      continue;
+    }
+    switch (value.GetKind()) {
+      case BinaryExpr::Kind::ADD: {
+        basic.emplace(name, std::make_pair(&assign, c));
+        break;
+      }
+      case BinaryExpr::Kind::SUB: {
+        if (value.GetLHS().GetKind() == Expr::Kind::REF) {
+          basic.emplace(name, std::make_pair(&assign, -c));
+        }
+        break;
+      }
+      default: {
+        break;
+      }
+    }
+  }
+
+  // Group the products of basic variables by their factors. Steps are
+  // computed modulo 2^64, as the products wrap around.
+  std::map<std::pair<std::string, int64_t>, size_t> index;
+  for (auto *product : scan.Products) {
+    auto [ref, k] = Split(*product);
+    auto it = basic.find(ref->GetName());
+    if (it == basic.end()) {
+      continue;
+    }
+    auto key = std::make_pair(ref->GetName(), static_cast<int64_t>(k));
+    auto jt = index.find(key);
+    if (jt == index.end()) {
+      jt = index.emplace(key, derived_.size()).first;
+      Derived d;
+      d.Base = ref->GetName();
+      d.Scale = static_cast<int64_t>(k);
+      d.Update = it->second.first;
+      d.Step = static_cast<int64_t>(it->second.second * k);
+      derived_.push_back(d);
+    }
+    derived_[jt->second].Exprs.push_back(product);
+  }
+}
@@ -0,0 +1,54 @@
+// This file is part of the IMP project.
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "ast.h"
+
+
+
+/**
+ * Induction variables of a while loop.
+ *
+ * A basic induction variable is an argument or a local declared outside of
+ * the loop which is assigned exactly once in the loop, by a statement of the
+ * body of the form i = i + c, i = c + i or i = i - c, where c is a constant.
+ *
+ * The products i * k and k * i of a basic induction variable with a constant
+ * are derived induction variables: each update of i changes them by c * k,
+ * so they can be maintained with an addition instead of being multiplied
+ * again whenever they are evaluated. Products wrap around on overflow, as
+ * do the additions maintaining them.
+ */
+class InductionAnalysis {
+public:
+  /// Product of a basic induction variable with a constant.
+  struct Derived {
+    /// Name of the basic induction variable.
+    std::string Base;
+    /// Constant factor.
+    int64_t Scale;
+    /// Assignment updating the basic induction variable.
+    const AssignStmt *Update;
+    /// Change of the product on each update.
+    int64_t Step;
+    /// Occurrences of the product in the loop.
+    std::vector<const BinaryExpr *> Exprs;
+  };
+
+  using DerivedList = std::vector<Derived>;
+
+public:
+  /// Finds the induction variables of a loop.
+  InductionAnalysis(const WhileStmt &loop);
+
+  DerivedList::const_iterator begin() const { return derived_.begin(); }
+  DerivedList::const_iterator end() const { return derived_.end(); }
+
+private:
+  /// Derived induction variables, grouped by base and factor.
+  DerivedList derived_;
+};
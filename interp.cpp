@@ -2,8 +2,11 @@
 
 #include "interp.h"
 #include "program.h"
+#include "trace.h"
 
+#include <algorithm>
 #include <iostream>
+#include <sstream>
 
 
 
@@ -11,47 +14,219 @@
 void Interp::Run()
 {
   for (;;) {
+    auto at = pc_;
     auto op = prog_.Read<Opcode>(pc_);
     switch (op) {
       case Opcode::PUSH_FUNC: {
-        Push(prog_.Read<size_t>(pc_));
+        Value v(prog_.Read<size_t>(pc_));
+        v.Arity = prog_.Read<unsigned>(pc_);
+        Push(v);
         continue;
       }
       case Opcode::PUSH_PROTO: {
-        Push(prog_.Read<RuntimeFn>(pc_));
+        Value v(prog_.Read<RuntimeFn>(pc_));
+        v.Arity = prog_.Read<unsigned>(pc_);
+        Push(v);
         continue;
       }
       case Opcode::PUSH_INT: {
-        Push(prog_.Read<int64_t>(pc_));
+        auto val = prog_.Read<int64_t>(pc_);
+        if (val == 0 || val == 1) {
+          prog_.Patch(at, val ? Opcode::PUSH_INT_1 : Opcode::PUSH_INT_0);
+        }
+        Push(val);
+        continue;
+      }
+      case Opcode::PUSH_INT_0: {
+        pc_ += sizeof(int64_t);
+        Push<int64_t>(0);
+        continue;
+      }
+      case Opcode::PUSH_INT_1: {
+        pc_ += sizeof(int64_t);
+        Push<int64_t>(1);
+        continue;
+      }
+      case Opcode::MAKE_CLOSURE: {
+        auto n = prog_.Read<unsigned>(pc_);
+        auto fn = Pop();
+        assert(fn.Kind == Value::Kind::ADDR);
+        auto &env = closures_.emplace_back();
+        env.Addr = fn.Val.Addr;
+        env.Captures.assign(stack_.end() - n, stack_.end());
+        stack_.resize(stack_.size() - n);
+        // The captures are passed along with the arguments of the call.
+        Value v(&env);
+        v.Arity = fn.Arity - n;
+        Push(v);
         continue;
       }
       case Opcode::PEEK: {
         auto idx = prog_.Read<unsigned>(pc_);
+        if (idx < 4) {
+          auto quick = static_cast<unsigned>(Opcode::PEEK_0) + idx;
+          prog_.Patch(at, static_cast<Opcode>(quick));
+        }
         Push(*(stack_.rbegin() + idx));
         continue;
       }
+      case Opcode::PEEK_0: {
+        pc_ += sizeof(unsigned);
+        Push(stack_.back());
+        continue;
+      }
+      case Opcode::PEEK_1: {
+        pc_ += sizeof(unsigned);
+        Push(*(stack_.rbegin() + 1));
+        continue;
+      }
+      case Opcode::PEEK_2: {
+        pc_ += sizeof(unsigned);
+        Push(*(stack_.rbegin() + 2));
+        continue;
+      }
+      case Opcode::PEEK_3: {
+        pc_ += sizeof(unsigned);
+        Push(*(stack_.rbegin() + 3));
+        continue;
+      }
+      case Opcode::DUP: {
+        Push(stack_.back());
+        continue;
+      }
+      case Opcode::OVER: {
+        Push(*(stack_.rbegin() + 1));
+        continue;
+      }
+      case Opcode::SWAP: {
+        std::swap(stack_.rbegin()[0], stack_.rbegin()[1]);
+        continue;
+      }
+      case Opcode::ROT: {
+        // Brings the third value to the top: a b c -> b c a.
+        auto it = stack_.end() - 3;
+        std::rotate(it, it + 1, stack_.end());
+        continue;
+      }
+      case Opcode::STORE: {
+        // Overwrites a slot below the value, indexed like PEEK once the
+        // value is popped.
+        auto idx = prog_.Read<unsigned>(pc_);
+        auto v = Pop();
+        *(stack_.rbegin() + idx) = v;
+        continue;
+      }
       case Opcode::POP: {
         Pop();
         continue;
       }
+      case Opcode::POPN: {
+        auto n = prog_.Read<unsigned>(pc_);
+        stack_.resize(stack_.size() - n);
+        continue;
+      }
       case Opcode::CALL: {
+        auto nargs = prog_.Read<unsigned>(pc_);
         auto callee = Pop();
         switch (callee.Kind) {
           case Value::Kind::PROTO: {
-            (*callee.Val.Proto) (*this);
+            CheckArity(callee, nargs);
+            prog_.Patch(at, Opcode::CALL_PROTO);
+            CallProto(callee.Val.Proto);
             continue;
           }
           case Value::Kind::ADDR: {
+            CheckArity(callee, nargs);
+            prog_.Patch(at, Opcode::CALL_FUNC);
             Push(pc_);
             pc_ = callee.Val.Addr;
             continue;
           }
+          case Value::Kind::CLOSURE: {
+            CheckArity(callee, nargs);
+            prog_.Patch(at, Opcode::CALL_CLOSURE);
+            EnterClosure(*callee.Val.Env, nargs);
+            continue;
+          }
+          case Value::Kind::GENERATOR: {
+            throw RuntimeError("cannot call generator");
+          }
           case Value::Kind::INT: {
             throw RuntimeError("cannot call integer");
           }
         }
         continue;
       }
+      case Opcode::CALL_FUNC: {
+        if (stack_.back().Kind != Value::Kind::ADDR) {
+          Deoptimise(at, Opcode::CALL);
+          continue;
+        }
+        CheckArity(stack_.back(), prog_.Read<unsigned>(pc_));
+        auto addr = Pop().Val.Addr;
+        Push(pc_);
+        pc_ = addr;
+        continue;
+      }
+      case Opcode::CALL_PROTO: {
+        if (stack_.back().Kind != Value::Kind::PROTO) {
+          Deoptimise(at, Opcode::CALL);
+          continue;
+        }
+        CheckArity(stack_.back(), prog_.Read<unsigned>(pc_));
+        CallProto(Pop().Val.Proto);
+        continue;
+      }
+      case Opcode::CALL_CLOSURE: {
+        if (stack_.back().Kind != Value::Kind::CLOSURE) {
+          Deoptimise(at, Opcode::CALL);
+          continue;
+        }
+        auto nargs = prog_.Read<unsigned>(pc_);
+        CheckArity(stack_.back(), nargs);
+        EnterClosure(*Pop().Val.Env, nargs);
+        continue;
+      }
+      case Opcode::GEN_CREATE: {
+        // Moves the arguments to the stack of a new generator, in place of
+        // the frame being entered, and returns the generator to the caller.
+        // The return address is never used, but keeps argument indices.
+        auto nargs = prog_.Read<unsigned>(pc_);
+        auto ret = PopAddr();
+        Generator *gen;
+        if (freeGenerators_.empty()) {
+          gen = &generators_.emplace_back();
+        } else {
+          gen = freeGenerators_.back();
+          freeGenerators_.pop_back();
+          gen->Done = false;
+          gen->Epoch += 1;
+        }
+        gen->Stack.assign(stack_.end() - nargs, stack_.end());
+        gen->Stack.emplace_back();
+        gen->Pc = pc_;
+        stack_.resize(stack_.size() - nargs);
+        Value v(gen);
+        v.Epoch = gen->Epoch;
+        Push(v);
+        pc_ = ret;
+        continue;
+      }
+      case Opcode::GEN_YIELD: {
+        auto v = Pop();
+        Suspend();
+        Push(v);
+        continue;
+      }
+      case Opcode::GEN_RETURN: {
+        auto v = Pop();
+        auto &gen = Suspend();
+        gen.Done = true;
+        std::vector<Value>().swap(gen.Stack);
+        freeGenerators_.push_back(&gen);
+        Push(v);
+        continue;
+      }
       case Opcode::ADD: {
         auto rhs = PopInt();
         auto lhs = PopInt();
@@ -86,13 +261,23 @@ void Interp::Run()
       	Push(res);
       	continue;
       }//add here mul and div as well
+      case Opcode::ADD_NOCHECK: {
+        // Strength-reduced slots rely on wrapping, done in unsigned types.
+        auto rhs = PopInt();
+        auto lhs = PopInt();
+        Push(static_cast<int64_t>(static_cast<uint64_t>(lhs) + rhs));
+        continue;
+      }
+      case Opcode::SUB_NOCHECK: {
+        auto rhs = PopInt();
+        auto lhs = PopInt();
+        Push(static_cast<int64_t>(static_cast<uint64_t>(lhs) - rhs));
+        continue;
+      }
       case Opcode::MUL: {
         auto rhs = PopInt();
         auto lhs = PopInt();
-
-        long res = rhs * lhs;
-
-        Push(res);
+        Push(static_cast<int64_t>(static_cast<uint64_t>(lhs) * rhs));
         continue;
       }
       case Opcode::DIV: {
@@ -119,11 +304,26 @@ void Interp::Run()
         Push(res);
         continue;
       }
+      case Opcode::DIV_CONST:
+      case Opcode::MOD_CONST: {
+        // The divisor is a non-zero constant: no check is needed.
+        DivMagic magic;
+        magic.Divisor = prog_.Read<int64_t>(pc_);
+        magic.Multiplier = prog_.Read<int64_t>(pc_);
+        magic.Shift = prog_.Read<uint32_t>(pc_);
+        auto lhs = PopInt();
+        if (op == Opcode::DIV_CONST) {
+          Push(magic.Divide(lhs));
+        } else {
+          Push(magic.Remainder(lhs));
+        }
+        continue;
+      }
       case Opcode::GREATER: {
         auto rhs = PopInt();
         auto lhs = PopInt();
 
-        long res = rhs > lhs;
+        long res = lhs > rhs;
 
         Push(res);
         continue;
@@ -132,7 +332,7 @@ void Interp::Run()
         auto rhs = PopInt();
         auto lhs = PopInt();
 
-        long res = rhs < lhs;
+        long res = lhs < rhs;
         
         Push(res);
         continue;
@@ -141,7 +341,7 @@ void Interp::Run()
         auto rhs = PopInt();
         auto lhs = PopInt();
 
-        long res = rhs >= lhs;
+        long res = lhs >= rhs;
         
         Push(res);
         continue;
@@ -150,7 +350,7 @@ void Interp::Run()
         auto rhs = PopInt();
         auto lhs = PopInt();
 
-        long res = rhs <= lhs;
+        long res = lhs <= rhs;
         
         Push(res);
         continue;
@@ -159,7 +359,7 @@ void Interp::Run()
         auto rhs = PopInt();
         auto lhs = PopInt();
 
-        long res = rhs == lhs;
+        long res = lhs == rhs;
         
         Push(res);
         continue;
@@ -177,6 +377,21 @@ void Interp::Run()
       case Opcode::JUMP_FALSE: {
         auto cond = Pop();
         auto addr = prog_.Read<size_t>(pc_);
+        if (cond.Kind == Value::Kind::INT) {
+          prog_.Patch(at, Opcode::JUMP_FALSE_INT);
+        }
+        if (!cond) {
+          pc_ = addr;
+        }
+        continue;
+      }
+      case Opcode::JUMP_FALSE_INT: {
+        if (stack_.back().Kind != Value::Kind::INT) {
+          Deoptimise(at, Opcode::JUMP_FALSE);
+          continue;
+        }
+        auto cond = PopInt();
+        auto addr = prog_.Read<size_t>(pc_);
         if (!cond) {
           pc_ = addr;
         }
@@ -186,9 +401,87 @@ void Interp::Run()
         pc_ = prog_.Read<size_t>(pc_);
         continue;
       }
+      case Opcode::LAZY: {
+        // Compile the function and turn the stub into a jump to its code.
+        auto id = prog_.Read<size_t>(pc_);
+        if (!compiler_) {
+          throw RuntimeError("no compiler for lazy function");
+        }
+        pc_ = compiler_(id);
+        prog_.Patch(at, Opcode::JUMP);
+        prog_.Write<size_t>(at + 1, pc_);
+        continue;
+      }
       case Opcode::STOP: {
         return;
       }
     }
   }
 }
+
+// -----------------------------------------------------------------------------
+void Interp::Deoptimise(size_t at, Opcode op)
+{
+  // The generic instruction is re-executed and might quicken the site again.
+  prog_.Patch(at, op);
+  pc_ = at;
+}
+
+// -----------------------------------------------------------------------------
+void Interp::CallProto(RuntimeFn fn)
+{
+  if (trace_) {
+    trace_->Call(*this, fn);
+  } else {
+    (*fn) (*this);
+  }
+}
+
+// -----------------------------------------------------------------------------
+void Interp::CheckArity(const Value &callee, unsigned nargs)
+{
+  if (callee.Arity != nargs) {
+    std::ostringstream os;
+    os << "wrong number of arguments: expected " << callee.Arity;
+    os << ", got " << nargs;
+    throw RuntimeError(os.str());
+  }
+}
+
+// -----------------------------------------------------------------------------
+void Interp::EnterClosure(const Closure &env, unsigned nargs)
+{
+  // The captures are the last arguments, so they go below the others.
+  stack_.insert(stack_.end() - nargs, env.Captures.begin(), env.Captures.end());
+  Push(pc_);
+  pc_ = env.Addr;
+}
+
+// -----------------------------------------------------------------------------
+void Interp::Resume(Generator &gen)
+{
+  if (gen.Done) {
+    throw RuntimeError("generator is exhausted");
+  }
+  if (gen.Running) {
+    throw RuntimeError("generator is already running");
+  }
+  gen.Running = true;
+  gen.Parent = current_;
+  current_ = &gen;
+  std::swap(stack_, gen.Stack);
+  std::swap(pc_, gen.Pc);
+}
+
+// -----------------------------------------------------------------------------
+Interp::Generator &Interp::Suspend()
+{
+  // The code which resumed the generator continues after its call.
+  auto &gen = *current_;
+  std::swap(stack_, gen.Stack);
+  std::swap(pc_, gen.Pc);
+  current_ = gen.Parent;
+  gen.Parent = nullptr;
+  gen.Running = false;
+  return gen;
+}
@@ -3,12 +3,17 @@
 #pragma once
 
 #include <cassert>
+#include <deque>
+#include <functional>
+#include <iostream>
 #include <vector>
 #include <stdexcept>
 
 #include "runtime.h"
 
 class Program;
+class RuntimeTrace;
+enum class Opcode : uint8_t;
 
 
 
@@ -22,26 +27,54 @@ public:
 
 /**
  * Interpreter for the bytecode.
+ *
+ * The interpreter does not check operands or stack bounds: programs must
+ * be accepted by the BytecodeVerifier before they are executed.
+ *
+ * Generic instructions which dispatch on the kind of their operands are
+ * quickened in place: once executed, they are rewritten into a variant
+ * specialised for the kind that was observed. Quickened instructions only
+ * guard the kind of their operand and, if the guard fails, revert to the
+ * generic form before executing it. Small constants and peek indices are
+ * also folded into the opcode, skipping over the operand. Quickening never
+ * changes the length of an instruction, so addresses remain valid.
  */
 class Interp {
 public:
+  struct Closure;
+  struct Generator;
+
   /// A dynamically-typed value stored on top of the stack.
   struct Value {
     enum class Kind {
       PROTO,
       ADDR,
+      CLOSURE,
+      GENERATOR,
       INT,
     } Kind;
 
+    union {
+      /// Number of arguments expected by functions, prototypes and closures,
+      /// checked by calls whose target is not known statically.
+      unsigned Arity = 0;
+      /// Epoch of the slot of a generator when the generator was created.
+      unsigned Epoch;
+    };
+
     union {
       RuntimeFn Proto;
       size_t Addr;
+      const Closure *Env;
+      Generator *Gen;
       int64_t Int;
     } Val;
 
     Value() : Kind(Kind::INT) { Val.Int = 0; }
     Value(RuntimeFn val) : Kind(Kind::PROTO) { Val.Proto = val; }
     Value(size_t val) : Kind(Kind::ADDR) { Val.Addr = val; }
+    Value(const Closure *val) : Kind(Kind::CLOSURE) { Val.Env = val; }
+    Value(Generator *val) : Kind(Kind::GENERATOR) { Val.Gen = val; }
     Value(int64_t val) : Kind(Kind::INT) { Val.Int = val; }
 
     operator bool () const
@@ -49,19 +82,82 @@ public:
       switch (Kind) {
         case Kind::PROTO: return true;
         case Kind::ADDR: return true;
+        case Kind::CLOSURE: return true;
+        case Kind::GENERATOR: return true;
         case Kind::INT: return Val.Int != 0;
       }
       return false;
     }
   };
 
+  /**
+   * Environment of a closure which escapes the function creating it.
+   *
+   * Calls insert the captured values below the arguments, where the code
+   * of the closure expects its extra arguments. Environments are owned by
+   * the interpreter and live as long as it does: values are not reference
+   * counted, so there is no way to tell when an environment is unused.
+   */
+  struct Closure {
+    /// Address of the code of the closure.
+    size_t Addr;
+    /// Captured values, in the order they are laid out on the stack.
+    std::vector<Value> Captures;
+  };
+
+  /**
+   * Coroutine created by a call to a function which yields.
+   *
+   * Each generator runs on its own stack, holding its arguments and locals.
+   * Resuming a generator exchanges its stack and program counter with the
+   * ones of the code resuming it, which are exchanged back when it yields
+   * or returns, so suspending and resuming never copies the frames.
+   * Generators are owned by the interpreter. Once a generator returns, its
+   * stack is freed and its slot is reused by the next generator created,
+   * after advancing the epoch of the slot: values created with an earlier
+   * epoch refer to a generator which is done.
+   */
+  struct Generator {
+    /// Stack of the generator while suspended, or of its caller while running.
+    std::vector<Value> Stack;
+    /// Address to resume from, or of the caller while running.
+    size_t Pc;
+    /// Generator which resumed this one, null for the top-level code.
+    Generator *Parent = nullptr;
+    /// True while the generator is executing.
+    bool Running = false;
+    /// True once the generator has returned.
+    bool Done = false;
+    /// Number of generators which used the slot before this one.
+    unsigned Epoch = 0;
+  };
+
+  /// Callback compiling a function on demand, returning its address.
+  using LazyCompiler = std::function<size_t(size_t)>;
+
 public:
-  /// Creates an interpreter for a given program.
-  Interp(Program &prog) : prog_(prog) {}
+  /// Creates an interpreter for a given program, with its I/O streams.
+  Interp(Program &prog, std::istream &in = std::cin, std::ostream &out = std::cout)
+    : prog_(prog)
+    , in_(in)
+    , out_(out)
+  {
+    finished_.Done = true;
+  }
+
+  /// Sets the callback invoked by the stubs of lazily-compiled functions.
+  void SetLazyCompiler(LazyCompiler compiler) { compiler_ = compiler; }
+  /// Routes the calls to runtime methods through a trace.
+  void SetTrace(RuntimeTrace *trace) { trace_ = trace; }
 
   /// Interpreter main loop.
   void Run();
 
+  /// Return the stream the program reads its input from.
+  std::istream &GetInput() { return in_; }
+  /// Return the stream the program writes its output to.
+  std::ostream &GetOutput() { return out_; }
+
   /// Pop a value from the stack.
   Value Pop()
   {
@@ -87,6 +183,26 @@ public:
     return v.Val.Addr;
   }
 
+  /// Pop a generator from the stack.
+  Generator &PopGenerator()
+  {
+    auto v = Pop();
+    if (v.Kind != Value::Kind::GENERATOR) {
+      throw RuntimeError("not a generator");
+    }
+    if (v.Epoch != v.Val.Gen->Epoch) {
+      return finished_;
+    }
+    return *v.Val.Gen;
+  }
+
+  /// Look at the nth value from the top of the stack.
+  const Value &Peek(unsigned idx) const
+  {
+    assert(idx < stack_.size() && "stack empty");
+    return *(stack_.rbegin() + idx);
+  }
+
   /// Look at the integer on top of the stack.
   int64_t PeekInt()
   {
@@ -102,11 +218,44 @@ public:
     stack_.emplace_back(std::forward<const T>(t));
   }
 
+  /// Switch to a generator, until it yields or returns a value.
+  void Resume(Generator &gen);
+
+private:
+  /// Rewrite a quickened instruction back to its generic form and retry it.
+  void Deoptimise(size_t at, Opcode op);
+  /// Check that a callee expects the number of arguments it is called with.
+  void CheckArity(const Value &callee, unsigned nargs);
+  /// Invoke a runtime method, through the trace if there is one.
+  void CallProto(RuntimeFn fn);
+  /// Pass the captures of a closure along with n arguments and enter it.
+  void EnterClosure(const Closure &env, unsigned nargs);
+  /// Switch from the running generator back to the code which resumed it.
+  Generator &Suspend();
+
 private:
   /// Reference to the program being executed.
   Program &prog_;
+  /// Input of the program.
+  std::istream &in_;
+  /// Output of the program.
+  std::ostream &out_;
   /// Program counter.
   size_t pc_ = 0;
   /// Evaluation stack.
   std::vector<Value> stack_;
+  /// Environments of the closures created by the program.
+  std::deque<Closure> closures_;
+  /// Generators created by the program.
+  std::deque<Generator> generators_;
+  /// Slots of the generators which returned, to be reused.
+  std::vector<Generator *> freeGenerators_;
+  /// Stands for the generators whose slot was reused.
+  Generator finished_;
+  /// Generator being executed, null for the top-level code.
+  Generator *current_ = nullptr;
+  /// Callback compiling functions on demand.
+  LazyCompiler compiler_;
+  /// Trace recording or replaying runtime calls, if any.
+  RuntimeTrace *trace_ = nullptr;
 };
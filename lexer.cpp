@@ -1,6 +1,9 @@
 // This file is part of the IMP project.
 
+#include <algorithm>
+#include <fstream>
 #include <sstream>
+#include <thread>
 
 #include "lexer.h"
 
@@ -62,6 +65,30 @@ Token &Token::operator=(const Token &that)
   return *this;
 }
 
+// -----------------------------------------------------------------------------
+Token::Token(Token &&that)
+  : loc_(that.loc_)
+  , kind_(that.kind_)
+  , value_(that.value_)
+{
+  that.kind_ = Kind::END;
+}
+
+// -----------------------------------------------------------------------------
+Token &Token::operator=(Token &&that)
+{
+  if (this != &that) {
+    if (kind_ == Kind::STRING || kind_ == Kind::IDENT) {
+      delete value_.StringValue;
+    }
+    loc_ = that.loc_;
+    kind_ = that.kind_;
+    value_ = that.value_;
+    that.kind_ = Kind::END;
+  }
+  return *this;
+}
+
 // -----------------------------------------------------------------------------
 Token::~Token()
 {
@@ -137,6 +164,7 @@ std::ostream &operator<<(std::ostream &os, const Token::Kind kind)
     case Token::Kind::IF: return os << "if";
     case Token::Kind::ELSE: return os << "else";
     case Token::Kind::LET: return os << "let";
+    case Token::Kind::YIELD: return os << "yield";
     case Token::Kind::LPAREN: return os << "(";
     case Token::Kind::RPAREN: return os << ")";
     case Token::Kind::LBRACE: return os << "{";
@@ -145,10 +173,12 @@ std::ostream &operator<<(std::ostream &os, const Token::Kind kind)
     case Token::Kind::SEMI: return os << ";";
     case Token::Kind::EQUAL: return os << "=";
     case Token::Kind::COMMA: return os << ",";
+    case Token::Kind::AT: return os << "@";
     case Token::Kind::PLUS: return os << "+";
     case Token::Kind::MINUS: return os << "-";
     case Token::Kind::MUL: return os << "*";
     case Token::Kind::DIV: return os << "/";
+    case Token::Kind::MOD: return os << "%";
     case Token::Kind::GREATER: return os << ">";
     case Token::Kind::LOWER: return os << "<";
     case Token::Kind::GREATER_EQ: return os << ">=";
@@ -179,12 +209,114 @@ LexerError::LexerError(const Location &loc, const std::string &msg)
 // -----------------------------------------------------------------------------
 Lexer::Lexer(const std::string &name)
   : name_(name)
-  , is_(name)
+  , locName_(name_)
+{
+  std::ifstream is(name);
+  if (!is) {
+    Error("cannot open file");
+  }
+  std::ostringstream os;
+  os << is.rdbuf();
+  buf_ = os.str();
+  src_ = buf_;
+
+  NextChar();
+  Next();
+}
+
+// -----------------------------------------------------------------------------
+Lexer::Lexer(const std::string &name, std::string &&source)
+  : name_(name)
+  , locName_(name_)
+  , buf_(std::move(source))
+  , src_(buf_)
 {
   NextChar();
   Next();
 }
 
+// -----------------------------------------------------------------------------
+Lexer::Lexer(std::string_view name, std::string_view source)
+  : locName_(name)
+  , src_(source)
+{
+}
+
+// -----------------------------------------------------------------------------
+void Lexer::Tokenize(unsigned threads)
+{
+  // Pick the start of each chunk, along with its line number.
+  size_t n = std::max<size_t>(std::min<size_t>(threads, src_.size() / kMinChunkSize), 1);
+  std::vector<std::pair<size_t, int>> starts{ { 0, 1 } };
+  bool inString = false;
+  int line = 1;
+  for (size_t i = 0, size = src_.size(); i < size && starts.size() < n; ++i) {
+    if (src_[i] == '"') {
+      inString = !inString;
+    } else if (src_[i] == '\n') {
+      ++line;
+      if (!inString && i + 1 >= starts.size() * size / n) {
+        starts.emplace_back(i + 1, line);
+      }
+    }
+  }
+
+  struct Chunk {
+    std::vector<Token> Tokens;
+    std::exception_ptr Error;
+    bool Complete = true;
+  };
+  std::vector<Chunk> chunks(starts.size());
+  auto lex = [&, this] (size_t i) {
+    size_t begin = starts[i].first;
+    size_t end = i + 1 < starts.size() ? starts[i + 1].first : src_.size();
+    Lexer lexer(locName_, src_.substr(begin, end - begin));
+    if (i != 0) {
+      // Resume as if a newline was just read.
+      lexer.lineNo_ = starts[i].second - 1;
+      lexer.chr_ = '\n';
+    }
+    auto &chunk = chunks[i];
+    try {
+      lexer.NextChar();
+      do {
+        lexer.Next();
+        chunk.Tokens.push_back(std::move(lexer.tk_));
+      } while (chunk.Tokens.back());
+      // Lexing stops early if a null character is encountered.
+      chunk.Complete = lexer.pos_ >= lexer.src_.size();
+    } catch (...) {
+      chunk.Error = std::current_exception();
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < chunks.size(); ++i) {
+    workers.emplace_back(lex, i);
+  }
+  lex(0);
+  for (auto &worker : workers) {
+    worker.join();
+  }
+
+  // Concatenate the chunks up to the first error or end of the source.
+  tokens_.clear();
+  for (auto &chunk : chunks) {
+    bool last = chunk.Error || !chunk.Complete || &chunk == &chunks.back();
+    if (!last) {
+      chunk.Tokens.pop_back();
+    }
+    std::move(chunk.Tokens.begin(), chunk.Tokens.end(), std::back_inserter(tokens_));
+    if (last) {
+      error_ = chunk.Error;
+      break;
+    }
+  }
+
+  next_ = 0;
+  Next();
+}
+
 // -----------------------------------------------------------------------------
 static bool IsIdentStart(char chr)
 {
@@ -200,6 +332,15 @@ static bool IsIdentLetter(char chr)
 // -----------------------------------------------------------------------------
 const Token &Lexer::Next()
 {
+  if (!tokens_.empty() || error_) {
+    if (next_ < tokens_.size()) {
+      cur_ = &tokens_[next_++];
+    } else if (error_) {
+      std::rethrow_exception(error_);
+    }
+    return *cur_;
+  }
+
   // Skip all whitespace until a valid token.
   while (isspace(chr_)) { NextChar(); }
 
@@ -242,6 +383,7 @@ const Token &Lexer::Next()
       }
     }
     case ',': return NextChar(), tk_ = Token::Comma(loc);
+    case '@': return NextChar(), tk_ = Token::At(loc);
     // case '>': return NextChar(), tk_ = Token::Greater(loc);
     case '"': {
       std::string word;
@@ -289,6 +431,7 @@ const Token &Lexer::Next()
         if (word == "if") return tk_ = Token::If(loc);
         if (word == "else") return tk_ = Token::Else(loc);
         if (word == "let") return tk_ = Token::Let(loc);
+        if (word == "yield") return tk_ = Token::Yield(loc);
         return tk_ = Token::Ident(loc, word);
       }
       Error("unknown character '" + std::string(1, chr_) + "'");
@@ -299,7 +442,7 @@ const Token &Lexer::Next()
 // -----------------------------------------------------------------------------
 void Lexer::NextChar()
 {
-  if (is_.eof()) {
+  if (pos_ >= src_.size()) {
     chr_ = '\0';
   } else {
     if (chr_ == '\n') {
@@ -308,8 +451,32 @@ void Lexer::NextChar()
     } else {
       charNo_++;
     }
-    is_.get(chr_);
+    chr_ = src_[pos_++];
+  }
+}
+
+// -----------------------------------------------------------------------------
+Lexer::Mark Lexer::GetMark()
+{
+  if (!tokens_.empty()) {
+    return { next_, lineNo_, charNo_, chr_, *cur_ };
+  }
+  return { pos_, lineNo_, charNo_, chr_, tk_ };
+}
+
+// -----------------------------------------------------------------------------
+void Lexer::Seek(const Mark &mark)
+{
+  if (!tokens_.empty()) {
+    next_ = mark.Pos;
+    cur_ = &tokens_[next_ - 1];
+    return;
   }
+  pos_ = mark.Pos;
+  lineNo_ = mark.Line;
+  charNo_ = mark.Column;
+  chr_ = mark.Chr;
+  tk_ = mark.Tk;
 }
 
 // -----------------------------------------------------------------------------
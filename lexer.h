@@ -3,9 +3,12 @@
 #pragma once
 
 #include <cassert>
-#include <fstream>
+#include <exception>
 #include <iostream>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
 
 
 /**
@@ -40,6 +43,7 @@ public:
     IF,
     ELSE,
     LET,
+    YIELD,
     // Symbols.
     LPAREN,
     RPAREN,
@@ -49,6 +53,7 @@ public:
     SEMI,
     EQUAL,
     COMMA,
+    AT,
     PLUS,
     MINUS,
     MUL,
@@ -69,6 +74,8 @@ public:
 public:
   /// Copy constructor.
   Token(const Token &that);
+  /// Move constructor, taking over the payload.
+  Token(Token &&that);
   /// Default constructor, EOF token.
   Token() : kind_(Kind::END) {}
   /// Cleanup.
@@ -108,6 +115,8 @@ public:
 
   /// Copy operator.
   Token &operator=(const Token &that);
+  /// Move operator, taking over the payload.
+  Token &operator=(Token &&that);
 
   // Helpers to build tokens.
   static Token End(const Location &l) { return Token(l, Kind::END); }
@@ -132,6 +141,7 @@ public:
   static Token Mod(const Location &l) { return Token(l, Kind::MOD); }
 
   static Token Comma(const Location &l) { return Token(l, Kind::COMMA); }
+  static Token At(const Location &l) { return Token(l, Kind::AT); }
   static Token Func(const Location &l) { return Token(l, Kind::FUNC); }
   static Token Return(const Location &l) { return Token(l, Kind::RETURN); }
   static Token While(const Location &l) { return Token(l, Kind::WHILE); }
@@ -142,6 +152,7 @@ public:
 
   //let
   static Token Let(const Location &l) { return Token(l, Kind::LET); }
+  static Token Yield(const Location &l) { return Token(l, Kind::YIELD); }
 
   static Token Ident(const Location &l, const std::string &str);
   static Token String(const Location &l, const std::string &str);
@@ -188,34 +199,81 @@ public:
  * Splits a stream of characters into a stream of tokens.
  */
 class Lexer final {
+public:
+  /// Position in the stream from which lexing can be resumed. If the
+  /// source was tokenized in advance, the position is a token index.
+  struct Mark {
+    size_t Pos;
+    int Line;
+    int Column;
+    char Chr;
+    Token Tk;
+  };
+
 public:
   /// Initialise the lexer, reading the file located at 'name'.
   Lexer(const std::string &name);
+  /// Initialise the lexer with an in-memory source, named 'name'.
+  Lexer(const std::string &name, std::string &&source);
+
+  /**
+   * Splits the whole source into tokens in advance.
+   *
+   * Large sources are split into chunks, starting at lines which are not
+   * part of string literals, which are lexed on up to 'threads' threads.
+   * Errors are only raised once the position of the error is reached.
+   */
+  void Tokenize(unsigned threads);
 
   /// Advance the stream to the next token.
   const Token &Next();
   /// Return the current token.
-  const Token &GetToken() const { return tk_; }
+  const Token &GetToken() const { return *cur_; }
+
+  /// Record the current position, including the current token.
+  Mark GetMark();
+  /// Return to a previously recorded position.
+  void Seek(const Mark &mark);
+
+  /// Minimal size of the chunks lexed on separate threads.
+  static constexpr size_t kMinChunkSize = 1 << 16;
 
 private:
+  /// Initialise a lexer for a chunk of the source of another lexer.
+  Lexer(std::string_view name, std::string_view source);
+
   /// Advance the stream to the next character. Return '\0' on EOF.
   void NextChar();
   /// Return the location of the current token.
-  Location GetLocation() const { return { name_, lineNo_, charNo_ }; }
+  Location GetLocation() const { return { locName_, lineNo_, charNo_ }; }
   /// Report an error.
   [[noreturn]] void Error(const std::string &msg);
 
 private:
   /// Current file name.
   const std::string name_;
+  /// File name referenced by locations, owned by the lexer of the file.
+  std::string_view locName_;
   /// Current line number.
   int lineNo_ = 1;
   /// Current character number.
   int charNo_ = 1;
   /// Current character.
   char chr_ = '\0';
-  /// Current stream.
-  std::ifstream is_;
-  /// Current token.
+  /// Buffer holding the source read by the lexer.
+  std::string buf_;
+  /// Source being lexed.
+  std::string_view src_;
+  /// Position of the next character in the source.
+  size_t pos_ = 0;
+  /// Current token, when lexing on demand.
   Token tk_;
+  /// Pointer to the current token.
+  const Token *cur_ = &tk_;
+  /// Tokens of the source, if it was tokenized in advance.
+  std::vector<Token> tokens_;
+  /// Index of the next token to return.
+  size_t next_ = 0;
+  /// Error raised after the last token.
+  std::exception_ptr error_;
 };
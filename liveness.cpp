@@ -0,0 +1,70 @@
+// This file is part of the IMP project.
+
+#include "liveness.h"
+#include "visitor.h"
+
+
+
+// -----------------------------------------------------------------------------
+using UseMap = std::unordered_map<std::string, unsigned>;
+
+/**
+ * Counts the references to each name in a statement. Assignments count as
+ * uses, since they need the slot of the variable.
+ */
+class UseCollector final : public AstVisitor<UseCollector> {
+public:
+  UseCollector(UseMap &uses) : uses_(uses) {}
+
+  bool VisitRefExpr(const RefExpr &expr)
+  {
+    uses_[expr.GetName()]++;
+    return true;
+  }
+
+  bool VisitAssignStmt(const AssignStmt &stmt)
+  {
+    uses_[stmt.GetName()]++;
+    return true;
+  }
+
+private:
+  UseMap &uses_;
+};
+
+// -----------------------------------------------------------------------------
+BlockLiveness::BlockLiveness(const BlockStmt &block)
+{
+  // Lifted closures read the variables they capture when they are called,
+  // so a call uses all the names referenced by the closure.
+  std::unordered_map<std::string, UseMap> closures;
+
+  size_t i = 0;
+  for (auto &stmt : block) {
+    UseMap uses;
+    UseCollector(uses).TraverseStmt(*stmt);
+    for (auto &[name, captures] : closures) {
+      if (uses.count(name)) {
+        for (auto &[capture, n] : captures) {
+          uses[capture]++;
+        }
+      }
+    }
+    for (auto &[name, n] : uses) {
+      last_[name] = { i, n };
+    }
+
+    if (stmt->GetKind() == Stmt::Kind::LET) {
+      auto &let = static_cast<const LetStmt &>(*stmt);
+      auto init = let.GetInitialisation();
+      if (init && init->GetKind() == Expr::Kind::FUNC) {
+        auto &captures = closures[let.GetName()];
+        captures.clear();
+        UseCollector(captures).TraverseExpr(*init);
+      } else {
+        closures.erase(let.GetName());
+      }
+    }
+    ++i;
+  }
+}
@@ -0,0 +1,42 @@
+// This file is part of the IMP project.
+
+#pragma once
+
+#include <string>
+#include <unordered_map>
+
+#include "ast.h"
+
+
+
+/**
+ * Liveness of the names referenced by the statements of a block.
+ *
+ * Names are tracked conservatively: references from nested scopes are
+ * counted even if they refer to a shadowing declaration, which can only
+ * extend the lifetime of a local. Calls to closures declared in the block
+ * count as uses of all the names referenced by the closures.
+ */
+class BlockLiveness {
+public:
+  /// Computes liveness information for the statements of a block.
+  BlockLiveness(const BlockStmt &block);
+
+  /// Check whether a name is referenced after the i-th statement.
+  bool IsLiveAfter(size_t i, const std::string &name) const
+  {
+    auto it = last_.find(name);
+    return it != last_.end() && it->second.first > i;
+  }
+
+  /// Check whether the i-th statement holds the only remaining reference.
+  bool IsLastUse(size_t i, const std::string &name) const
+  {
+    auto it = last_.find(name);
+    return it != last_.end() && it->second.first == i && it->second.second == 1;
+  }
+
+private:
+  /// Index of the last statement using each name and the number of uses in it.
+  std::unordered_map<std::string, std::pair<size_t, unsigned>> last_;
+};
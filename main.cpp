@@ -1,41 +1,248 @@
 // This file is part of the IMP project.
 
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <sstream>
+#include <string_view>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "ast.h"
+#include "batch.h"
+#include "bytecode.h"
+#include "callgraph.h"
 #include "codegen.h"
 #include "interp.h"
 #include "lexer.h"
 #include "parser.h"
+#include "readahead.h"
+#include "trace.h"
 #include "verifier.h"
 
 
 
+// -----------------------------------------------------------------------------
+static int Usage(const char *exeName)
+{
+  std::cerr << "Usage: " << exeName << " [options] path-to-file|-" << std::endl;
+  std::cerr << "Options:" << std::endl;
+  std::cerr << "  --callgraph=dot|json  print the call graph and exit" << std::endl;
+  std::cerr << "  --unroll=N            unroll small loops N times (1 disables)" << std::endl;
+  std::cerr << "  --clone=N             clone up to N functions for constant arguments" << std::endl;
+  std::cerr << "  --lazy                compile functions when first called" << std::endl;
+  std::cerr << "  --input=FILE          read the input of the program from FILE" << std::endl;
+  std::cerr << "  --read-ahead          read the input on a separate thread" << std::endl;
+  std::cerr << "  --batch=N             run once per input line, N lines at a time" << std::endl;
+  std::cerr << "  --record=FILE         log the I/O of the run to FILE" << std::endl;
+  std::cerr << "  --replay=FILE         replay the I/O logged to FILE, without I/O" << std::endl;
+  return EXIT_FAILURE;
+}
+
 // -----------------------------------------------------------------------------
 int main(int argc, char **argv)
 {
   const char *exeName = argc < 1 ? "imp" : argv[0];
 
-  if (argc != 2) {
-    std::cerr << "Usage: " << exeName << " path-to-file" << std::endl;
-    return EXIT_FAILURE;
+  // Parse the command-line options.
+  const char *path = nullptr;
+  std::string_view callgraph;
+  Codegen::Options opts;
+  bool lazy = false;
+  const char *input = nullptr;
+  bool readAhead = false;
+  unsigned batch = 0;
+  const char *record = nullptr;
+  const char *replay = nullptr;
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg(argv[i]);
+    if (arg.substr(0, 8) == "--input=") {
+      input = argv[i] + 8;
+      continue;
+    }
+    if (arg.substr(0, 8) == "--batch=") {
+      batch = std::atoi(argv[i] + 8);
+      if (batch == 0) {
+        return Usage(exeName);
+      }
+      continue;
+    }
+    if (arg.substr(0, 9) == "--record=") {
+      record = argv[i] + 9;
+      continue;
+    }
+    if (arg.substr(0, 9) == "--replay=") {
+      replay = argv[i] + 9;
+      continue;
+    }
+    if (arg == "--read-ahead") {
+      readAhead = true;
+      continue;
+    }
+    if (arg == "--lazy") {
+      lazy = true;
+      continue;
+    }
+    if (arg.substr(0, 9) == "--unroll=") {
+      opts.UnrollFactor = std::atoi(argv[i] + 9);
+      if (opts.UnrollFactor == 0) {
+        return Usage(exeName);
+      }
+      continue;
+    }
+    if (arg.substr(0, 8) == "--clone=") {
+      opts.Clone.MaxClones = std::atoi(argv[i] + 8);
+      continue;
+    }
+    if (arg.substr(0, 12) == "--callgraph=") {
+      callgraph = arg.substr(12);
+      if (callgraph != "dot" && callgraph != "json") {
+        return Usage(exeName);
+      }
+      continue;
+    }
+    if (path || (arg.size() > 1 && arg[0] == '-')) {
+      return Usage(exeName);
+    }
+    path = argv[i];
+  }
+  if (!path) {
+    return Usage(exeName);
+  }
+  if ((record && replay) || (batch && (record || replay))) {
+    return Usage(exeName);
   }
 
   try {
-    // The lexer splits the source into a stream of tokens.
-    Lexer lexer(argv[1]);
+    // The lexer splits the source into a stream of tokens. The source is
+    // read from stdin if the path is '-'.
+    std::unique_ptr<Lexer> lexerPtr;
+    if (std::string_view(path) == "-") {
+      std::ostringstream os;
+      os << std::cin.rdbuf();
+      lexerPtr = std::make_unique<Lexer>("<stdin>", os.str());
+    } else {
+      lexerPtr = std::make_unique<Lexer>(path);
+    }
+    auto &lexer = *lexerPtr;
+    lexer.Tokenize(std::thread::hardware_concurrency());
 
     // The parser processes the tokens from the lexer to build the AST.
-    auto ast = Parser(lexer).ParseModule();
+    Parser parser(lexer, lazy);
+    auto ast = parser.ParseModule();
 
     // The verifier checks the program and emits warnings/errors.
     Verifier().Verify(*ast);
 
+    // Dump the call graph if requested.
+    if (!callgraph.empty()) {
+      for (auto item : *ast) {
+        if (auto *func = std::get_if<std::shared_ptr<FuncDecl>>(&item)) {
+          if (!(*func)->HasBody()) {
+            parser.ParseBody(**func);
+            Verifier().VerifyFunc(**func);
+          }
+        }
+      }
+      CallGraph graph(*ast);
+      if (callgraph == "dot") {
+        graph.PrintDot(std::cout);
+      } else {
+        graph.PrintJson(std::cout);
+      }
+      return EXIT_SUCCESS;
+    }
+
     // The code generator translates the AST into bytecode.
-    auto prog = Codegen().Translate(*ast);
+    Codegen codegen(opts);
+    auto prog = codegen.Translate(*ast);
+
+    // The bytecode verifier checks the program before it is executed. It is
+    // kept to check the functions compiled later, along with the new code.
+    BytecodeVerifier verifier;
+    verifier.Verify(*prog);
+
+    // The bytecode interpreter runs the bytecode. Functions skipped by the
+    // parser are parsed, compiled and verified when first called.
+    // With read-ahead, a separate thread reads the input into a ring of
+    // buffers, overlapping the latency of slow sources with execution.
+    std::ifstream inputFile;
+    std::unique_ptr<ReadAheadBuf> readAheadBuf;
+    if (readAhead) {
+      int fd = input ? open(input, O_RDONLY) : STDIN_FILENO;
+      if (fd < 0) {
+        std::cerr << "cannot open input file " << input << std::endl;
+        return EXIT_FAILURE;
+      }
+      readAheadBuf = std::make_unique<ReadAheadBuf>(fd, input != nullptr);
+    } else if (input) {
+      inputFile.open(input);
+      if (!inputFile) {
+        std::cerr << "cannot open input file " << input << std::endl;
+        return EXIT_FAILURE;
+      }
+    }
+    std::istream readAheadStream(readAheadBuf.get());
+    std::istream &in = readAhead ? readAheadStream : input ? inputFile : std::cin;
+    auto compile = [&] (size_t id) {
+      auto &func = codegen.GetLazyFunc(id);
+      parser.ParseBody(func);
+      Verifier().VerifyFunc(func);
+      auto addr = codegen.TranslateLazy(id, *prog);
+      verifier.Verify(*prog, addr, func.arg_size());
+      return addr;
+    };
+
+    // In batch mode, each line of the input is a record processed by its
+    // own run of the program. Outputs are printed one per line, in order.
+    if (batch) {
+      std::vector<std::string> records;
+      for (std::string line; std::getline(in, line); ) {
+        records.push_back(line);
+      }
+      BatchInterp interp(*prog, batch);
+      interp.SetLazyCompiler(compile);
+      int status = EXIT_SUCCESS;
+      auto results = interp.Run(records);
+      for (size_t i = 0; i < results.size(); ++i) {
+        std::cout << results[i].Output << std::endl;
+        if (results[i].Error) {
+          std::cerr << "record " << i + 1 << ": " << *results[i].Error << std::endl;
+          status = EXIT_FAILURE;
+        }
+      }
+      return status;
+    }
+
+    // Runs can be recorded to a log, which is later replayed instead of
+    // performing the I/O, reproducing the same execution.
+    std::ofstream recordFile;
+    std::ifstream replayFile;
+    std::unique_ptr<RuntimeTrace> trace;
+    if (record) {
+      recordFile.open(record, std::ios::binary);
+      if (!recordFile) {
+        std::cerr << "cannot open record file " << record << std::endl;
+        return EXIT_FAILURE;
+      }
+      trace = std::make_unique<TraceRecorder>(recordFile);
+    }
+    if (replay) {
+      replayFile.open(replay, std::ios::binary);
+      if (!replayFile) {
+        std::cerr << "cannot open replay file " << replay << std::endl;
+        return EXIT_FAILURE;
+      }
+      trace = std::make_unique<TraceReplayer>(replayFile);
+    }
 
-    // The bytecode interpreter runs the bytecode.
-    Interp(*prog).Run();
+    Interp interp(*prog, in);
+    interp.SetLazyCompiler(compile);
+    interp.SetTrace(trace.get());
+    interp.Run();
 
   } catch (const std::exception &ex) {
     // Report any exceptions (parser, lexer, verification, runtime errors).
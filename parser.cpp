@@ -24,8 +24,9 @@ ParserError::ParserError(const Location &loc, const std::string &msg)
 
 
 // -----------------------------------------------------------------------------
-Parser::Parser(Lexer &lexer)
+Parser::Parser(Lexer &lexer, bool lazy)
   : lexer_(lexer)
+  , lazy_(lazy)
 {
 }
 
@@ -34,26 +35,22 @@ std::shared_ptr<Module> Parser::ParseModule()
 {
   std::vector<TopLevelStmt> body;
   while (auto tk = Current()) {
-    if (tk.Is(Token::Kind::FUNC)) {
+    if (tk.Is(Token::Kind::AT) || tk.Is(Token::Kind::FUNC)) {
+      // Parse the attributes preceding the declaration.
+      FuncOrProtoDecl::AttrSet attrs = 0;
+      while (Current().Is(Token::Kind::AT)) {
+        attrs |= FuncOrProtoDecl::GetAttrMask(ParseAttr());
+        lexer_.Next();
+      }
+      Check(Token::Kind::FUNC);
+
       // Parse a function prototype or declaration.
       std::string name(Expect(Token::Kind::IDENT).GetIdent());
       Expect(Token::Kind::LPAREN);
-
-      std::vector<std::pair<std::string, std::string>> args;
-      while (!lexer_.Next().Is(Token::Kind::RPAREN)) {
-        std::string arg(Current().GetIdent());
-        Expect(Token::Kind::COLON);
-        std::string type(Expect(Token::Kind::IDENT).GetIdent());
-        args.emplace_back(arg, type);
-
-        if (!lexer_.Next().Is(Token::Kind::COMMA)) {
-          break;
-        }
-      }
-      Check(Token::Kind::RPAREN);
+      auto args = ParseArgList();
 
       Expect(Token::Kind::COLON);
-      std::string type(Expect(Token::Kind::IDENT).GetIdent());
+      std::string type(ExpectType());
 
       if (lexer_.Next().Is(Token::Kind::EQUAL)) {
         std::string primitive(Expect(Token::Kind::STRING).GetString());
@@ -62,15 +59,31 @@ std::shared_ptr<Module> Parser::ParseModule()
             name,
             std::move(args),
             type,
-            primitive
+            primitive,
+            attrs
         ));
+      } else if (lazy_ && !(attrs & FuncOrProtoDecl::GetAttrMask(FuncOrProtoDecl::Attr::PURE))) {
+        // Record the start of the body to parse it on first use. Pure
+        // functions are parsed eagerly since the verifier inspects them.
+        auto mark = lexer_.GetMark();
+        SkipBlockStmt();
+        auto func = std::make_shared<FuncDecl>(
+            name,
+            std::move(args),
+            type,
+            nullptr,
+            attrs
+        );
+        skipped_.emplace(func.get(), std::make_pair(func, mark));
+        body.push_back(func);
       } else {
         auto block = ParseBlockStmt();
         body.push_back(std::make_shared<FuncDecl>(
             name,
             std::move(args),
             type,
-            block
+            block,
+            attrs
         ));
       }
     } else {
@@ -81,17 +94,62 @@ std::shared_ptr<Module> Parser::ParseModule()
   return std::make_unique<Module>(std::move(body));
 }
 
+// -----------------------------------------------------------------------------
+void Parser::ParseBody(const FuncDecl &func)
+{
+  auto it = skipped_.find(&func);
+  assert(it != skipped_.end() && "function body was not skipped");
+  auto &[decl, mark] = it->second;
+  lexer_.Seek(mark);
+  decl->SetBody(ParseBlockStmt());
+  skipped_.erase(it);
+}
+
+// -----------------------------------------------------------------------------
+FuncOrProtoDecl::ArgList Parser::ParseArgList()
+{
+  Check(Token::Kind::LPAREN);
+
+  FuncOrProtoDecl::ArgList args;
+  while (!lexer_.Next().Is(Token::Kind::RPAREN)) {
+    std::string arg(Current().GetIdent());
+    Expect(Token::Kind::COLON);
+    std::string type(ExpectType());
+    args.emplace_back(arg, type);
+
+    if (!lexer_.Next().Is(Token::Kind::COMMA)) {
+      break;
+    }
+  }
+  Check(Token::Kind::RPAREN);
+  return args;
+}
+
+// -----------------------------------------------------------------------------
+FuncOrProtoDecl::Attr Parser::ParseAttr()
+{
+  Check(Token::Kind::AT);
+  const auto &tk = Expect(Token::Kind::IDENT);
+  auto name = tk.GetIdent();
+  if (name == "pure") return FuncOrProtoDecl::Attr::PURE;
+  if (name == "noinline") return FuncOrProtoDecl::Attr::NOINLINE;
+  if (name == "hot") return FuncOrProtoDecl::Attr::HOT;
+  if (name == "cold") return FuncOrProtoDecl::Attr::COLD;
+  Error(tk.GetLocation(), "unknown attribute '" + std::string(name) + "'");
+}
+
 // -----------------------------------------------------------------------------
 std::shared_ptr<Stmt> Parser::ParseStmt()
 {
   auto tk = Current();
   switch (tk.GetKind()) {
     case Token::Kind::RETURN: return ParseReturnStmt();
+    case Token::Kind::YIELD: return ParseYieldStmt();
     case Token::Kind::WHILE: return ParseWhileStmt();
     case Token::Kind::IF: return ParseIfStmt();
     case Token::Kind::LBRACE: return ParseBlockStmt();
     case Token::Kind::LET: return ParseLetStmt();
-    default: return std::make_shared<ExprStmt>(ParseExpr());
+    default: return ParseExprOrAssignStmt();
   }
 }
 
@@ -112,6 +170,22 @@ std::shared_ptr<BlockStmt> Parser::ParseBlockStmt()
   return std::make_shared<BlockStmt>(std::move(body));
 }
 
+// -----------------------------------------------------------------------------
+void Parser::SkipBlockStmt()
+{
+  auto loc = Check(Token::Kind::LBRACE).GetLocation();
+  for (unsigned depth = 1; depth > 0; ) {
+    auto &tk = lexer_.Next();
+    switch (tk.GetKind()) {
+      case Token::Kind::LBRACE: depth++; break;
+      case Token::Kind::RBRACE: depth--; break;
+      case Token::Kind::END: Error(loc, "unterminated block");
+      default: break;
+    }
+  }
+  lexer_.Next();
+}
+
 // -----------------------------------------------------------------------------
 std::shared_ptr<ReturnStmt> Parser::ParseReturnStmt()
 {
@@ -121,6 +195,15 @@ std::shared_ptr<ReturnStmt> Parser::ParseReturnStmt()
   return std::make_shared<ReturnStmt>(expr);
 }
 
+// -----------------------------------------------------------------------------
+std::shared_ptr<YieldStmt> Parser::ParseYieldStmt()
+{
+  Check(Token::Kind::YIELD);
+  lexer_.Next();
+  auto expr = ParseExpr();
+  return std::make_shared<YieldStmt>(expr);
+}
+
 // -----------------------------------------------------------------------------
 std::shared_ptr<WhileStmt> Parser::ParseWhileStmt()
 {
@@ -160,7 +243,7 @@ std::shared_ptr<LetStmt> Parser::ParseLetStmt()
   Check(Token::Kind::LET);
   std::string name(Expect(Token::Kind::IDENT).GetIdent());
   Expect(Token::Kind::COLON);
-  std::string type(Expect(Token::Kind::IDENT).GetIdent());
+  std::string type(ExpectType());
   lexer_.Next();
 
   if(Current().Is(Token::Kind::EQUAL)){
@@ -172,6 +255,23 @@ std::shared_ptr<LetStmt> Parser::ParseLetStmt()
   return std::make_shared<LetStmt>(name, type, nullptr);
 }
 
+// -----------------------------------------------------------------------------
+std::shared_ptr<Stmt> Parser::ParseExprOrAssignStmt()
+{
+  auto loc = Current().GetLocation();
+  auto expr = ParseExpr();
+  if (!Current().Is(Token::Kind::EQUAL)) {
+    return std::make_shared<ExprStmt>(expr);
+  }
+  if (expr->GetKind() != Expr::Kind::REF) {
+    Error(loc, "invalid assignment target");
+  }
+  lexer_.Next();
+  auto value = ParseExpr();
+  auto &name = static_cast<const RefExpr &>(*expr).GetName();
+  return std::make_shared<AssignStmt>(name, value);
+}
+
 // -----------------------------------------------------------------------------
 std::shared_ptr<Expr> Parser::ParseTermExpr()
 {
@@ -180,16 +280,15 @@ std::shared_ptr<Expr> Parser::ParseTermExpr()
     case Token::Kind::IDENT: {
       std::string ident(tk.GetIdent());
       lexer_.Next();
-      return std::static_pointer_cast<Expr>(
-          std::make_shared<RefExpr>(ident)
-      );
+      return exprs_.Ref(ident);
     }
     case Token::Kind::INT: {
       uint64_t value(tk.GetInt());
       lexer_.Next();
-      return std::static_pointer_cast<Expr>(
-          std::make_shared<IntExpr>(value)
-      );
+      return exprs_.Int(value);
+    }
+    case Token::Kind::FUNC: {
+      return ParseFuncExpr();
     }
     default: {
       std::ostringstream os;
@@ -199,6 +298,29 @@ std::shared_ptr<Expr> Parser::ParseTermExpr()
   }
 }
 
+// -----------------------------------------------------------------------------
+std::shared_ptr<Expr> Parser::ParseFuncExpr()
+{
+  // Closures are named after their location, which is unique and cannot
+  // clash with identifiers.
+  auto loc = Check(Token::Kind::FUNC).GetLocation();
+  std::ostringstream name;
+  name << "<closure " << loc.Line << ":" << loc.Column << ">";
+
+  Expect(Token::Kind::LPAREN);
+  auto args = ParseArgList();
+  Expect(Token::Kind::COLON);
+  std::string type(ExpectType());
+  lexer_.Next();
+  auto body = ParseBlockStmt();
+  return std::make_shared<FuncExpr>(std::make_shared<FuncDecl>(
+      name.str(),
+      std::move(args),
+      type,
+      body
+  ));
+}
+
 // -----------------------------------------------------------------------------
 std::shared_ptr<Expr> Parser::ParseCallExpr()
 {
@@ -223,22 +345,25 @@ std::shared_ptr<Expr> Parser::ParseCompExpr()
 {
   std::shared_ptr<Expr> term = ParseAddSubExpr();
   while (Current().Is(Token::Kind::GREATER) || Current().Is(Token::Kind::LOWER) || Current().Is(Token::Kind::GREATER_EQ) || Current().Is(Token::Kind::LOWER_EQ) || Current().Is(Token::Kind::IS_EQ)) {
-  
-  lexer_.Next();
-  auto rhs = ParseAddSubExpr();
 
+  // The operator must be identified before the right operand is parsed.
+  BinaryExpr::Kind kind;
   if(Current().Is(Token::Kind::GREATER)){
-    term = std::make_shared<BinaryExpr>(BinaryExpr::Kind::GREATER, term, rhs);
+    kind = BinaryExpr::Kind::GREATER;
   } else if (Current().Is(Token::Kind::LOWER)){
-    term = std::make_shared<BinaryExpr>(BinaryExpr::Kind::LOWER, term, rhs);
+    kind = BinaryExpr::Kind::LOWER;
   } else if (Current().Is(Token::Kind::GREATER_EQ)) {
-    term = std::make_shared<BinaryExpr>(BinaryExpr::Kind::GREATER_EQ, term, rhs);
+    kind = BinaryExpr::Kind::GREATER_EQ;
   } else if (Current().Is(Token::Kind::LOWER_EQ)) {
-    term = std::make_shared<BinaryExpr>(BinaryExpr::Kind::LOWER_EQ, term, rhs);
+    kind = BinaryExpr::Kind::LOWER_EQ;
   } else {
-    term = std::make_shared<BinaryExpr>(BinaryExpr::Kind::IS_EQ, term, rhs);
+    kind = BinaryExpr::Kind::IS_EQ;
   }
 
+  lexer_.Next();
+  auto rhs = ParseAddSubExpr();
+  term = exprs_.Binary(kind, term, rhs);
+
   }
   return term;
 }
@@ -251,11 +376,11 @@ std::shared_ptr<Expr> Parser::ParseAddSubExpr()
   if(Current().Is(Token::Kind::PLUS)){
     lexer_.Next();
     auto rhs = ParseMulDivModExpr();
-    term = std::make_shared<BinaryExpr>(BinaryExpr::Kind::ADD, term, rhs);
+    term = exprs_.Binary(BinaryExpr::Kind::ADD, term, rhs);
   } else {
     lexer_.Next();
     auto rhs = ParseMulDivModExpr();
-    term = std::make_shared<BinaryExpr>(BinaryExpr::Kind::SUB, term, rhs);
+    term = exprs_.Binary(BinaryExpr::Kind::SUB, term, rhs);
   }
 
   }
@@ -270,15 +395,15 @@ std::shared_ptr<Expr> Parser::ParseMulDivModExpr()
   if(Current().Is(Token::Kind::MUL)){
     lexer_.Next();
     auto rhs = ParseCallExpr();
-    term = std::make_shared<BinaryExpr>(BinaryExpr::Kind::MUL, term, rhs);
+    term = exprs_.Binary(BinaryExpr::Kind::MUL, term, rhs);
   } else if(Current().Is(Token::Kind::DIV)) {
     lexer_.Next();
     auto rhs = ParseCallExpr();
-    term = std::make_shared<BinaryExpr>(BinaryExpr::Kind::DIV, term, rhs);
+    term = exprs_.Binary(BinaryExpr::Kind::DIV, term, rhs);
   } else {
     lexer_.Next();
     auto rhs = ParseCallExpr();
-    term = std::make_shared<BinaryExpr>(BinaryExpr::Kind::MOD, term, rhs);
+    term = exprs_.Binary(BinaryExpr::Kind::MOD, term, rhs);
   }
 
   }
@@ -292,6 +417,16 @@ const Token &Parser::Expect(Token::Kind kind)
   return Check(kind);
 }
 
+// -----------------------------------------------------------------------------
+std::string Parser::ExpectType()
+{
+  // Closures are typed as func, which is a keyword.
+  if (lexer_.Next().Is(Token::Kind::FUNC)) {
+    return "func";
+  }
+  return std::string(Check(Token::Kind::IDENT).GetIdent());
+}
+
 // -----------------------------------------------------------------------------
 const Token &Parser::Check(Token::Kind kind)
 {
@@ -2,6 +2,7 @@
 
 #pragma once
 
+#include <map>
 #include <memory>
 
 #include "lexer.h"
@@ -22,21 +23,38 @@ public:
  */
 class Parser {
 public:
-  /// Initialise the parser given a reference to the lexer.
-  Parser(Lexer &lexer);
+  /**
+   * Initialise the parser given a reference to the lexer.
+   *
+   * In lazy mode, the bodies of functions are only skimmed to find their
+   * end and must be parsed later using ParseBody, before they are used.
+   * The lexer must outlive the parser in this mode.
+   */
+  Parser(Lexer &lexer, bool lazy = false);
 
   /**
    * Parse the top-level node, which consists of a series of statements.
    */
   std::shared_ptr<Module> ParseModule();
 
+  /// Parse the body of a function skipped in lazy mode.
+  void ParseBody(const FuncDecl &func);
+
 private:
+  /// Parse the arguments of a function: (<name>: <type>, ...)
+  FuncOrProtoDecl::ArgList ParseArgList();
+  /// Parse an attribute of a declaration: @name
+  FuncOrProtoDecl::Attr ParseAttr();
   /// Parse a single statement.
   std::shared_ptr<Stmt> ParseStmt();
   /// Parse a block of statements.
   std::shared_ptr<BlockStmt> ParseBlockStmt();
+  /// Skip over a block of statements, matching braces.
+  void SkipBlockStmt();
   /// Parse a return statement: return <expr>
   std::shared_ptr<ReturnStmt> ParseReturnStmt();
+  /// Parse a yield statement: yield <expr>
+  std::shared_ptr<YieldStmt> ParseYieldStmt();
   /// Parse a while loop.
   std::shared_ptr<WhileStmt> ParseWhileStmt();
 
@@ -45,11 +63,15 @@ private:
 
   /// Parse a let statement.
   std::shared_ptr<LetStmt> ParseLetStmt();
+  /// Parse an expression statement or an assignment: <name> = <expr>
+  std::shared_ptr<Stmt> ParseExprOrAssignStmt();
 
   /// Parse a single expression.
   std::shared_ptr<Expr> ParseExpr() { return ParseCompExpr(); }
   /// Parse an expression which has no operators.
   std::shared_ptr<Expr> ParseTermExpr();
+  /// Parse a function expression: func(<args>): <type> { ... }
+  std::shared_ptr<Expr> ParseFuncExpr();
   /// Parse a call expression.
   std::shared_ptr<Expr> ParseCallExpr();
   /// Parse an greater/lower/greater_equal/lower_equal expression.
@@ -63,6 +85,8 @@ private:
   inline const Token &Current() { return lexer_.GetToken(); }
   /// Check whether the next token is of a given kind, failing otherwise.
   const Token &Expect(Token::Kind kind);
+  /// Check whether the next token is a type name, failing otherwise.
+  std::string ExpectType();
   /// Check whether the current token is of a given kind, failing otherwise.
   const Token &Check(Token::Kind kind);
   /// Report an error.
@@ -70,4 +94,10 @@ private:
 
 private:
   Lexer &lexer_;
+  /// Factory sharing identical expressions.
+  ExprFactory exprs_;
+  /// Flag indicating whether function bodies are parsed on demand.
+  bool lazy_;
+  /// Functions whose bodies were skipped, along with their start.
+  std::map<const FuncDecl *, std::pair<std::shared_ptr<FuncDecl>, Lexer::Mark>> skipped_;
 };
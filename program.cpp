@@ -3,3 +3,44 @@
 #include "program.h"
 
 
+
+// -----------------------------------------------------------------------------
+DivMagic DivMagic::For(int64_t d)
+{
+  assert(IsValid(d) && "invalid divisor");
+
+  // Find the smallest shift for which the multiplier is exact for all
+  // dividends, following Hacker's Delight, section 10-4.
+  const uint64_t two63 = 1ull << 63;
+  uint64_t ad = d < 0 ? -static_cast<uint64_t>(d) : static_cast<uint64_t>(d);
+  uint64_t t = two63 + (static_cast<uint64_t>(d) >> 63);
+  uint64_t anc = t - 1 - t % ad;
+  uint32_t p = 63;
+  uint64_t q1 = two63 / anc;
+  uint64_t r1 = two63 - q1 * anc;
+  uint64_t q2 = two63 / ad;
+  uint64_t r2 = two63 - q2 * ad;
+  uint64_t delta;
+  do {
+    p++;
+    q1 = 2 * q1;
+    r1 = 2 * r1;
+    if (r1 >= anc) {
+      q1++;
+      r1 -= anc;
+    }
+    q2 = 2 * q2;
+    r2 = 2 * r2;
+    if (r2 >= ad) {
+      q2++;
+      r2 -= ad;
+    }
+    delta = ad - r2;
+  } while (q1 < delta || (q1 == delta && r1 == 0));
+
+  uint64_t m = q2 + 1;
+  if (d < 0) {
+    m = -m;
+  }
+  return { d, static_cast<int64_t>(m), p - 64 };
+}
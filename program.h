@@ -16,16 +16,39 @@ enum class Opcode : uint8_t {
   PUSH_FUNC,
   PUSH_PROTO,
   PUSH_INT,
+  PUSH_INT_0,
+  PUSH_INT_1,
+  MAKE_CLOSURE,
 
   PEEK,
+  PEEK_0,
+  PEEK_1,
+  PEEK_2,
+  PEEK_3,
+  DUP,
+  OVER,
+  SWAP,
+  ROT,
+  STORE,
   POP,
+  POPN,
   CALL,
+  CALL_FUNC,
+  CALL_PROTO,
+  CALL_CLOSURE,
+  GEN_CREATE,
+  GEN_YIELD,
+  GEN_RETURN,
 
   ADD,
   SUB,
+  ADD_NOCHECK,
+  SUB_NOCHECK,
   MUL,
   DIV,
   MOD,
+  DIV_CONST,
+  MOD_CONST,
   GREATER,
   LOWER,
   GREATER_EQ,
@@ -34,11 +57,58 @@ enum class Opcode : uint8_t {
   RET,
 
   JUMP_FALSE,
+  JUMP_FALSE_INT,
   JUMP,
+  LAZY,
   STOP
 };
 
 
+/**
+ * Constants dividing by an invariant integer with a multiplication, after
+ * Granlund and Montgomery. The high half of the product of the dividend
+ * with a magic multiplier is shifted and corrected for negative quotients,
+ * which are truncated towards zero, as with the division operator.
+ */
+struct DivMagic {
+  /// Divisor, such that IsValid(Divisor).
+  int64_t Divisor;
+  /// Magic multiplier.
+  int64_t Multiplier;
+  /// Right shift applied to the high half of the product.
+  uint32_t Shift;
+
+  /// Check whether division by a constant can use a multiplication.
+  static bool IsValid(int64_t d)
+  {
+    return d >= 2 || (d <= -2 && d != INT64_MIN);
+  }
+
+  /// Computes the constants for a divisor.
+  static DivMagic For(int64_t d);
+
+  /// Divides a value by the divisor.
+  int64_t Divide(int64_t n) const
+  {
+    __extension__ using Wide = __int128;
+    auto q = static_cast<int64_t>((static_cast<Wide>(Multiplier) * n) >> 64);
+    if (Divisor > 0 && Multiplier < 0) {
+      q += n;
+    }
+    if (Divisor < 0 && Multiplier > 0) {
+      q -= n;
+    }
+    q >>= Shift;
+    return q + static_cast<int64_t>(static_cast<uint64_t>(q) >> 63);
+  }
+
+  /// Computes the remainder of the division, with the sign of the dividend.
+  int64_t Remainder(int64_t n) const
+  {
+    return n - Divide(n) * Divisor;
+  }
+};
+
 /**
  * Holds the bytecode for a program.
  */
@@ -49,7 +119,7 @@ public:
 
   /// Read a value from a specific location.
   template<typename T>
-  T Read(size_t &pc)
+  T Read(size_t &pc) const
   {
     T t;
     assert(pc + sizeof(T) <= code_.size());
@@ -58,6 +128,32 @@ public:
     return t;
   }
 
+  /// Replace the opcode of the instruction at a specific location.
+  void Patch(size_t pc, Opcode op)
+  {
+    assert(pc < code_.size());
+    code_[pc] = static_cast<uint8_t>(op);
+  }
+
+  /// Overwrite a value at a specific location.
+  template<typename T>
+  void Write(size_t pc, const T &t)
+  {
+    assert(pc + sizeof(T) <= code_.size());
+    memcpy(code_.data() + pc, &t, sizeof(T));
+  }
+
+  /// Append code to the end of the program, returning its address.
+  size_t Append(const std::vector<uint8_t> &code)
+  {
+    size_t addr = code_.size();
+    code_.insert(code_.end(), code.begin(), code.end());
+    return addr;
+  }
+
+  /// Return the size of the bytecode, in bytes.
+  size_t GetSize() const { return code_.size(); }
+
 private:
   std::vector<uint8_t> code_;
 };
@@ -0,0 +1,236 @@
+// This file is part of the IMP project.
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "range.h"
+#include "visitor.h"
+
+
+
+// -----------------------------------------------------------------------------
+static constexpr int64_t kMin = std::numeric_limits<int64_t>::min();
+static constexpr int64_t kMax = std::numeric_limits<int64_t>::max();
+
+// -----------------------------------------------------------------------------
+static int64_t Abs(int64_t v)
+{
+  return v == kMin ? kMax : std::abs(v);
+}
+
+// -----------------------------------------------------------------------------
+void RangeAnalysis::Analyse(const Module &mod)
+{
+  for (auto item : mod) {
+    if (auto *func = std::get_if<std::shared_ptr<FuncDecl>>(&item)) {
+      if ((*func)->HasBody()) {
+        AnalyseFunc(**func);
+      }
+    }
+    if (auto *stmt = std::get_if<std::shared_ptr<Stmt>>(&item)) {
+      assigned_.clear();
+      AssignFinder(assigned_).TraverseStmt(**stmt);
+      scopes_.emplace_back();
+      AnalyseStmt(**stmt);
+      scopes_.pop_back();
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+void RangeAnalysis::AnalyseFunc(const FuncDecl &decl)
+{
+  assigned_.clear();
+  AssignFinder(assigned_).TraverseFuncDecl(decl);
+
+  // Arguments can take any value.
+  scopes_.emplace_back();
+  for (auto it = decl.arg_begin(), end = decl.arg_end(); it != end; ++it) {
+    scopes_.back().emplace(it->first, Range::Full());
+  }
+  AnalyseStmt(decl.GetBody());
+  scopes_.pop_back();
+}
+
+// -----------------------------------------------------------------------------
+void RangeAnalysis::AnalyseStmt(const Stmt &stmt)
+{
+  switch (stmt.GetKind()) {
+    case Stmt::Kind::BLOCK: {
+      scopes_.emplace_back();
+      for (auto &s : static_cast<const BlockStmt &>(stmt)) {
+        AnalyseStmt(*s);
+      }
+      scopes_.pop_back();
+      return;
+    }
+    case Stmt::Kind::WHILE: {
+      auto &whileStmt = static_cast<const WhileStmt &>(stmt);
+      AnalyseExpr(whileStmt.GetCond());
+      AnalyseStmt(whileStmt.GetStmt());
+      return;
+    }
+    case Stmt::Kind::IF: {
+      auto &ifStmt = static_cast<const IfStmt &>(stmt);
+      AnalyseExpr(ifStmt.GetCond());
+      AnalyseStmt(ifStmt.GetStmt());
+      if (auto elseStmt = ifStmt.GetElseStmt()) {
+        AnalyseStmt(*elseStmt);
+      }
+      return;
+    }
+    case Stmt::Kind::LET: {
+      auto &letStmt = static_cast<const LetStmt &>(stmt);
+      Range r = Range::Full();
+      if (auto init = letStmt.GetInitialisation()) {
+        r = AnalyseExpr(*init);
+      }
+      // The initial range does not hold after the local is assigned.
+      if (assigned_.count(letStmt.GetName())) {
+        r = Range::Full();
+      }
+      scopes_.back().insert_or_assign(letStmt.GetName(), r);
+      return;
+    }
+    case Stmt::Kind::ASSIGN: {
+      AnalyseExpr(static_cast<const AssignStmt &>(stmt).GetExpr());
+      return;
+    }
+    case Stmt::Kind::EXPR: {
+      AnalyseExpr(static_cast<const ExprStmt &>(stmt).GetExpr());
+      return;
+    }
+    case Stmt::Kind::RETURN: {
+      AnalyseExpr(static_cast<const ReturnStmt &>(stmt).GetExpr());
+      return;
+    }
+    case Stmt::Kind::YIELD: {
+      AnalyseExpr(static_cast<const YieldStmt &>(stmt).GetExpr());
+      return;
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+Range RangeAnalysis::AnalyseExpr(const Expr &expr)
+{
+  switch (expr.GetKind()) {
+    case Expr::Kind::REF: {
+      return Lookup(static_cast<const RefExpr &>(expr).GetName());
+    }
+    case Expr::Kind::BINARY: {
+      return AnalyseBinaryExpr(static_cast<const BinaryExpr &>(expr));
+    }
+    case Expr::Kind::CALL: {
+      auto &call = static_cast<const CallExpr &>(expr);
+      for (auto it = call.arg_rbegin(), end = call.arg_rend(); it != end; ++it) {
+        AnalyseExpr(**it);
+      }
+      AnalyseExpr(call.GetCallee());
+      return Range::Full();
+    }
+    case Expr::Kind::INT: {
+      auto n = static_cast<const IntExpr &>(expr).GetNumber();
+      return Range::Const(static_cast<int64_t>(n));
+    }
+    case Expr::Kind::FUNC: {
+      // Captured variables hold the values they had when the closure was
+      // created, so their ranges hold in the body.
+      auto &decl = static_cast<const FuncExpr &>(expr).GetDecl();
+      scopes_.emplace_back();
+      for (auto it = decl.arg_begin(), end = decl.arg_end(); it != end; ++it) {
+        scopes_.back().emplace(it->first, Range::Full());
+      }
+      AnalyseStmt(decl.GetBody());
+      scopes_.pop_back();
+      return Range::Full();
+    }
+  }
+  return Range::Full();
+}
+
+// -----------------------------------------------------------------------------
+Range RangeAnalysis::AnalyseBinaryExpr(const BinaryExpr &expr)
+{
+  Range l = AnalyseExpr(expr.GetLHS());
+  Range r = AnalyseExpr(expr.GetRHS());
+
+  switch (expr.GetKind()) {
+    case BinaryExpr::Kind::ADD: {
+      Range res;
+      bool safe = !__builtin_add_overflow(l.Lo, r.Lo, &res.Lo) &&
+                  !__builtin_add_overflow(l.Hi, r.Hi, &res.Hi);
+      MarkSafe(expr, safe);
+      return safe ? res : Range::Full();
+    }
+    case BinaryExpr::Kind::SUB: {
+      Range res;
+      bool safe = !__builtin_sub_overflow(l.Lo, r.Hi, &res.Lo) &&
+                  !__builtin_sub_overflow(l.Hi, r.Lo, &res.Hi);
+      MarkSafe(expr, safe);
+      return safe ? res : Range::Full();
+    }
+    case BinaryExpr::Kind::MUL: {
+      // The product wraps around on overflow.
+      int64_t p[4];
+      if (__builtin_mul_overflow(l.Lo, r.Lo, &p[0]) ||
+          __builtin_mul_overflow(l.Lo, r.Hi, &p[1]) ||
+          __builtin_mul_overflow(l.Hi, r.Lo, &p[2]) ||
+          __builtin_mul_overflow(l.Hi, r.Hi, &p[3]))
+      {
+        return Range::Full();
+      }
+      return { *std::min_element(p, p + 4), *std::max_element(p, p + 4) };
+    }
+    case BinaryExpr::Kind::DIV: {
+      // The magnitude of the quotient is bounded by that of the dividend.
+      // Its sign follows the dividend only if the divisor is positive; no
+      // bound is derived if the divisor can be zero or is unknown.
+      if (l.Lo == kMin || (r.Lo <= 0 && r.Hi >= 0)) {
+        return Range::Full();
+      }
+      int64_t m = std::max(Abs(l.Lo), Abs(l.Hi));
+      if (r.Hi < 0) {
+        return { -m, m };
+      }
+      return { l.Lo < 0 ? -m : 0, l.Hi > 0 ? m : 0 };
+    }
+    case BinaryExpr::Kind::MOD: {
+      // The remainder takes the sign of the dividend and its magnitude
+      // is lower than that of the divisor.
+      int64_t m = std::max(Abs(r.Lo), Abs(r.Hi));
+      m = std::min(m == 0 ? 0 : m - 1, std::max(Abs(l.Lo), Abs(l.Hi)));
+      return { l.Lo < 0 ? -m : 0, l.Hi > 0 ? m : 0 };
+    }
+    case BinaryExpr::Kind::GREATER:
+    case BinaryExpr::Kind::LOWER:
+    case BinaryExpr::Kind::GREATER_EQ:
+    case BinaryExpr::Kind::LOWER_EQ:
+    case BinaryExpr::Kind::IS_EQ: {
+      return { 0, 1 };
+    }
+  }
+  return Range::Full();
+}
+
+// -----------------------------------------------------------------------------
+void RangeAnalysis::MarkSafe(const BinaryExpr &expr, bool safe)
+{
+  if (safe && !unsafe_.count(&expr)) {
+    safe_.insert(&expr);
+  } else {
+    safe_.erase(&expr);
+    unsafe_.insert(&expr);
+  }
+}
+
+// -----------------------------------------------------------------------------
+Range RangeAnalysis::Lookup(const std::string &name) const
+{
+  for (auto it = scopes_.rbegin(); it != scopes_.rend(); ++it) {
+    if (auto jt = it->find(name); jt != it->end()) {
+      return jt->second;
+    }
+  }
+  return Range::Full();
+}
@@ -0,0 +1,85 @@
+// This file is part of the IMP project.
+
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+#include "ast.h"
+
+
+
+/**
+ * Closed interval of 64-bit integers.
+ */
+struct Range {
+  int64_t Lo;
+  int64_t Hi;
+
+  /// Range containing all integers.
+  static Range Full()
+  {
+    return {
+      std::numeric_limits<int64_t>::min(),
+      std::numeric_limits<int64_t>::max()
+    };
+  }
+
+  /// Range containing a single integer.
+  static Range Const(int64_t v) { return { v, v }; }
+
+  /// Check whether a value is in the range.
+  bool Contains(int64_t v) const { return Lo <= v && v <= Hi; }
+};
+
+/**
+ * Value-range analysis over integer expressions.
+ *
+ * Computes a conservative range for every expression in the module, starting
+ * from constants, comparisons and local bindings. Arguments, results of
+ * calls and locals which are assigned are unknown. The results are used to identify additions and
+ * subtractions which cannot overflow, removing the need for the checks.
+ * Since expressions are shared, an operation is only considered safe if
+ * it cannot overflow in any of the places where it occurs.
+ */
+class RangeAnalysis {
+public:
+  /// Analyses all the functions and top-level statements of a module.
+  void Analyse(const Module &mod);
+  /// Analyses a single function, skipped earlier if its body was not parsed.
+  void AnalyseFunc(const FuncDecl &decl);
+
+  /// Check whether an addition or subtraction never overflows.
+  bool IsOverflowFree(const BinaryExpr &expr) const
+  {
+    return safe_.count(&expr) != 0;
+  }
+
+private:
+  /// Analyses a statement.
+  void AnalyseStmt(const Stmt &stmt);
+  /// Computes the range of an expression.
+  Range AnalyseExpr(const Expr &expr);
+  /// Computes the range of a binary expression.
+  Range AnalyseBinaryExpr(const BinaryExpr &expr);
+  /// Records whether an operation can overflow in one of its contexts.
+  void MarkSafe(const BinaryExpr &expr, bool safe);
+
+  /// Find the range bound to a name.
+  Range Lookup(const std::string &name) const;
+
+private:
+  /// Chain of scopes mapping names to their ranges.
+  std::vector<std::map<std::string, Range>> scopes_;
+  /// Arithmetic expressions proven not to overflow.
+  std::unordered_set<const BinaryExpr *> safe_;
+  /// Arithmetic expressions which might overflow in some context.
+  std::unordered_set<const BinaryExpr *> unsafe_;
+  /// Variables assigned in the function being analysed.
+  std::set<std::string> assigned_;
+};
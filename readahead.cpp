@@ -0,0 +1,120 @@
+// This file is part of the IMP project.
+
+#include <cerrno>
+
+#include <poll.h>
+#include <unistd.h>
+
+#include "readahead.h"
+
+
+
+// -----------------------------------------------------------------------------
+ReadAheadBuf::ReadAheadBuf(int fd, bool owned)
+  : fd_(fd)
+  , owned_(owned)
+  , ring_(kBuffers)
+{
+  for (auto &buffer : ring_) {
+    buffer.Data = std::make_unique<char[]>(kBufferSize);
+    buffer.Size = 0;
+  }
+  thread_ = std::thread([this] { Fill(); });
+}
+
+// -----------------------------------------------------------------------------
+ReadAheadBuf::~ReadAheadBuf()
+{
+  stop_.store(true);
+  Notify();
+  thread_.join();
+  if (owned_) {
+    close(fd_);
+  }
+}
+
+// -----------------------------------------------------------------------------
+ReadAheadBuf::int_type ReadAheadBuf::underflow()
+{
+  if (gptr() < egptr()) {
+    return traits_type::to_int_type(*gptr());
+  }
+  if (eof_) {
+    return traits_type::eof();
+  }
+
+  // Return the exhausted buffer to the reader.
+  size_t released = released_.load(std::memory_order_relaxed);
+  if (reading_) {
+    released_.store(++released, std::memory_order_release);
+    reading_ = false;
+    Notify();
+  }
+
+  // Wait for the reader to publish the next buffer.
+  Wait([&] { return filled_.load(std::memory_order_acquire) > released; });
+  auto &buffer = ring_[released % kBuffers];
+  if (buffer.Size == 0) {
+    eof_ = true;
+    return traits_type::eof();
+  }
+  reading_ = true;
+  setg(buffer.Data.get(), buffer.Data.get(), buffer.Data.get() + buffer.Size);
+  return traits_type::to_int_type(*gptr());
+}
+
+// -----------------------------------------------------------------------------
+void ReadAheadBuf::Fill()
+{
+  for (size_t filled = 0; ; ) {
+    // Wait for a free buffer.
+    Wait([&] {
+      return stop_.load() || filled - released_.load(std::memory_order_acquire) < kBuffers;
+    });
+    if (stop_.load()) {
+      return;
+    }
+
+    // Wait for data, periodically checking whether the consumer is gone,
+    // as it can stop before the end of a pipe which stays open.
+    pollfd pfd{ fd_, POLLIN, 0 };
+    while (!stop_.load() && poll(&pfd, 1, 100) == 0) {
+    }
+    if (stop_.load()) {
+      return;
+    }
+
+    // Publish whatever is available, so a slow source does not hold back
+    // the consumer until a whole buffer is filled. Errors end the input.
+    auto &buffer = ring_[filled % kBuffers];
+    ssize_t n;
+    do {
+      n = read(fd_, buffer.Data.get(), kBufferSize);
+    } while (n < 0 && errno == EINTR);
+    buffer.Size = n < 0 ? 0 : n;
+    filled_.store(++filled, std::memory_order_release);
+    Notify();
+    if (buffer.Size == 0) {
+      return;
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+template <typename F>
+void ReadAheadBuf::Wait(F cond)
+{
+  if (cond()) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(lock_);
+  cond_.wait(lock, cond);
+}
+
+// -----------------------------------------------------------------------------
+void ReadAheadBuf::Notify()
+{
+  // Taking the lock orders the update before the check of a waiting side.
+  { std::lock_guard<std::mutex> lock(lock_); }
+  cond_.notify_all();
+}
@@ -0,0 +1,83 @@
+// This file is part of the IMP project.
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <streambuf>
+#include <thread>
+#include <vector>
+
+
+
+/**
+ * Stream buffer reading its input ahead of consumption on a separate thread.
+ *
+ * The reader thread fills a ring of large buffers from a file descriptor
+ * while the interpreter consumes the previous ones. The ring is a single
+ * producer, single consumer queue: the reader publishes a buffer by
+ * advancing the count of filled buffers and the consumer returns it by
+ * advancing the count of released ones, without locks. A side only blocks
+ * on the condition variable when the ring is empty or full.
+ *
+ * A buffer holding no data marks the end of the input.
+ */
+class ReadAheadBuf final : public std::streambuf {
+public:
+  /// Size of a buffer.
+  static constexpr size_t kBufferSize = 1 << 20;
+  /// Number of buffers in the ring.
+  static constexpr size_t kBuffers = 4;
+
+public:
+  /// Starts reading from a descriptor, which is closed at the end if owned.
+  ReadAheadBuf(int fd, bool owned);
+  ~ReadAheadBuf() override;
+
+protected:
+  int_type underflow() override;
+
+private:
+  /// Body of the reader thread.
+  void Fill();
+
+  /// Blocks until a condition set by the other side holds.
+  template <typename F>
+  void Wait(F cond);
+  /// Wakes up the other side after advancing a count.
+  void Notify();
+
+private:
+  /// Chunk of the input.
+  struct Buffer {
+    /// Storage of the chunk.
+    std::unique_ptr<char[]> Data;
+    /// Number of bytes read into the chunk.
+    size_t Size;
+  };
+
+  /// Descriptor of the input.
+  int fd_;
+  /// Set if the descriptor is closed by the buffer.
+  bool owned_;
+  /// Ring of buffers.
+  std::vector<Buffer> ring_;
+  /// Number of buffers filled by the reader.
+  std::atomic<size_t> filled_{ 0 };
+  /// Number of buffers released by the consumer.
+  std::atomic<size_t> released_{ 0 };
+  /// Set to stop the reader.
+  std::atomic<bool> stop_{ false };
+  /// Set while the consumer reads from the oldest filled buffer.
+  bool reading_ = false;
+  /// Set once the consumer reached the end of the input.
+  bool eof_ = false;
+  /// Lock and condition for the blocking slow path.
+  std::mutex lock_;
+  std::condition_variable cond_;
+  /// Reader thread, started once the ring is set up.
+  std::thread thread_;
+};
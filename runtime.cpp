@@ -1,5 +1,6 @@
 // This file is part of the IMP project.
 
+#include <algorithm>
 #include <iostream>
 
 #include "runtime.h"
@@ -10,21 +11,64 @@
 // -----------------------------------------------------------------------------
 static void PrintInt(Interp &interp)
 {
-  auto v = interp.PeekInt();
-  std::cout << v;
+  auto v = interp.PopInt();
+  interp.GetOutput() << v;
   interp.Push<int64_t>(v);
 }
 
 // -----------------------------------------------------------------------------
 static void ReadInt(Interp &interp)
 {
-  int64_t val;
-  std::cin >> val;
+  // Reading past the end of the input yields 0.
+  int64_t val = 0;
+  interp.GetInput() >> val;
   interp.Push<int64_t>(val);
 }
 
 // -----------------------------------------------------------------------------
-std::map<std::string, RuntimeFn> kRuntimeFns = {
-  { "print_int", PrintInt },
-  { "read_int", ReadInt }
+static void AbsInt(Interp &interp)
+{
+  auto v = interp.PopInt();
+  interp.Push<int64_t>(v < 0 ? static_cast<int64_t>(0ull - v) : v);
+}
+
+// -----------------------------------------------------------------------------
+static void MinInt(Interp &interp)
+{
+  auto a = interp.PopInt();
+  auto b = interp.PopInt();
+  interp.Push<int64_t>(std::min(a, b));
+}
+
+// -----------------------------------------------------------------------------
+static void MaxInt(Interp &interp)
+{
+  auto a = interp.PopInt();
+  auto b = interp.PopInt();
+  interp.Push<int64_t>(std::max(a, b));
+}
+
+// -----------------------------------------------------------------------------
+static void NextGen(Interp &interp)
+{
+  // The value is pushed once the generator yields or returns.
+  interp.Resume(interp.PopGenerator());
+}
+
+// -----------------------------------------------------------------------------
+static void DoneGen(Interp &interp)
+{
+  auto &gen = interp.PopGenerator();
+  interp.Push<int64_t>(gen.Done);
+}
+
+// -----------------------------------------------------------------------------
+std::map<std::string, RuntimeMethod> kRuntimeFns = {
+  { "print_int", { PrintInt, 1, false, true } },
+  { "read_int", { ReadInt, 0, false, true } },
+  { "abs_int", { AbsInt, 1, true, false } },
+  { "min_int", { MinInt, 2, true, false } },
+  { "max_int", { MaxInt, 2, true, false } },
+  { "gen_next", { NextGen, 1, false, false } },
+  { "gen_done", { DoneGen, 1, false, false } },
 };
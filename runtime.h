@@ -12,5 +12,21 @@ class Interp;
 /// Signature of runtime methods.
 typedef void (*RuntimeFn) (Interp &);
 
+/**
+ * Descriptor of a runtime method.
+ */
+struct RuntimeMethod {
+  /// Implementation of the method.
+  RuntimeFn Fn;
+  /// Number of arguments popped from the stack.
+  unsigned NumArgs;
+  /// True if the method has no side effects and its result only depends
+  /// on the values of its arguments.
+  bool IsPure;
+  /// True if the method reads the input or writes the output of the
+  /// program, so its calls are logged when recording a run.
+  bool PerformsIO;
+};
+
 /// Map of all runtime functions.
-extern std::map<std::string, RuntimeFn> kRuntimeFns;
+extern std::map<std::string, RuntimeMethod> kRuntimeFns;
@@ -0,0 +1,417 @@
+// This file is part of the IMP project.
+
+#include <algorithm>
+#include <limits>
+#include <sstream>
+
+#include "specialise.h"
+
+
+
+// -----------------------------------------------------------------------------
+void Specialiser::Run(const Module &mod)
+{
+  for (auto item : mod) {
+    if (auto *func = std::get_if<std::shared_ptr<FuncDecl>>(&item)) {
+      if ((*func)->HasBody()) {
+        funcs_.emplace((*func)->GetName(), func->get());
+      }
+    }
+  }
+
+  // Find the call sites with constant arguments in the original code.
+  auto visit = [this] (const FuncDecl &decl) {
+    scopes_.emplace_back();
+    for (auto it = decl.arg_begin(), end = decl.arg_end(); it != end; ++it) {
+      scopes_.back().insert(it->first);
+    }
+    TraverseStmt(decl.GetBody());
+    scopes_.pop_back();
+  };
+  for (auto item : mod) {
+    if (auto *func = std::get_if<std::shared_ptr<FuncDecl>>(&item)) {
+      if ((*func)->HasBody()) {
+        visit(**func);
+      }
+    }
+    if (auto *stmt = std::get_if<std::shared_ptr<Stmt>>(&item)) {
+      scopes_.emplace_back();
+      TraverseStmt(**stmt);
+      scopes_.pop_back();
+    }
+  }
+
+  // Constants propagated into the clones might enable further clones.
+  for (size_t i = 0; i < clones_.size(); ++i) {
+    auto clone = clones_[i];
+    visit(*clone);
+  }
+}
+
+// -----------------------------------------------------------------------------
+bool Specialiser::TraverseBlockStmt(const BlockStmt &stmt)
+{
+  scopes_.emplace_back();
+  AstVisitor::TraverseBlockStmt(stmt);
+  scopes_.pop_back();
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+bool Specialiser::TraverseLetStmt(const LetStmt &stmt)
+{
+  AstVisitor::TraverseLetStmt(stmt);
+  scopes_.back().insert(stmt.GetName());
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+bool Specialiser::TraverseFuncExpr(const FuncExpr &expr)
+{
+  auto &decl = expr.GetDecl();
+  scopes_.emplace_back();
+  for (auto it = decl.arg_begin(), end = decl.arg_end(); it != end; ++it) {
+    scopes_.back().insert(it->first);
+  }
+  AstVisitor::TraverseFuncExpr(expr);
+  scopes_.pop_back();
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+bool Specialiser::VisitCallExpr(const CallExpr &call)
+{
+  auto &callee = call.GetCallee();
+  if (callee.GetKind() != Expr::Kind::REF) {
+    return true;
+  }
+  auto *func = Resolve(static_cast<const RefExpr &>(callee).GetName());
+  if (!func || func->arg_size() != call.arg_size()) {
+    return true;
+  }
+
+  std::vector<std::optional<int64_t>> consts;
+  for (auto it = call.arg_rbegin(), end = call.arg_rend(); it != end; ++it) {
+    if ((*it)->GetKind() == Expr::Kind::INT) {
+      consts.push_back(static_cast<const IntExpr &>(**it).GetNumber());
+    } else {
+      consts.push_back(std::nullopt);
+    }
+  }
+  std::reverse(consts.begin(), consts.end());
+  if (std::none_of(consts.begin(), consts.end(), [] (auto &c) { return c; })) {
+    return true;
+  }
+
+  if (auto *clone = Specialise(*func, consts)) {
+    calls_.emplace(&call, clone);
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+const FuncDecl *Specialiser::Resolve(const std::string &name) const
+{
+  for (auto &scope : scopes_) {
+    if (scope.count(name)) {
+      return nullptr;
+    }
+  }
+  auto it = funcs_.find(name);
+  return it == funcs_.end() ? nullptr : it->second;
+}
+
+// -----------------------------------------------------------------------------
+const FuncDecl *Specialiser::Specialise(
+    const FuncDecl &func,
+    const std::vector<std::optional<int64_t>> &consts)
+{
+  auto key = std::make_pair(&func, consts);
+  if (auto it = keys_.find(key); it != keys_.end()) {
+    return it->second;
+  }
+  if (clones_.size() >= opts_.MaxClones) {
+    return nullptr;
+  }
+  NodeCounter counter;
+  counter.TraverseStmt(func.GetBody());
+  if (counter.Count > opts_.MaxSize) {
+    return nullptr;
+  }
+
+  // Closures would capture the substituted arguments.
+  class ClosureFinder final : public AstVisitor<ClosureFinder> {
+  public:
+    bool VisitFuncExpr(const FuncExpr &) { return false; }
+  };
+  if (!ClosureFinder().TraverseStmt(func.GetBody())) {
+    return nullptr;
+  }
+
+  // Constant arguments which are assigned become locals of the clone.
+  std::set<std::string> assigned;
+  AssignFinder(assigned).TraverseFuncDecl(func);
+
+  // The clone is named after the constants, such as exp<_,2>. The name
+  // cannot clash with identifiers from the source.
+  std::ostringstream name;
+  std::vector<ConstScope> env(1);
+  std::vector<std::pair<std::string, std::string>> args;
+  BlockStmt::BlockList body;
+  name << func.GetName() << "<";
+  size_t i = 0;
+  for (auto it = func.arg_begin(), end = func.arg_end(); it != end; ++it, ++i) {
+    name << (i ? "," : "");
+    if (consts[i]) {
+      name << *consts[i];
+    } else {
+      name << "_";
+      args.push_back(*it);
+    }
+    if (consts[i] && assigned.count(it->first)) {
+      std::string arg = it->first;
+      std::string type = it->second;
+      body.push_back(std::make_shared<LetStmt>(arg, type, exprs_.Int(*consts[i])));
+      env[0][arg] = std::nullopt;
+    } else {
+      env[0][it->first] = consts[i];
+    }
+  }
+  name << ">";
+
+  body.push_back(RewriteBlock(env, func.GetBody()));
+  auto clone = std::make_shared<FuncDecl>(
+      name.str(),
+      std::move(args),
+      func.GetType(),
+      body.size() == 1
+          ? std::static_pointer_cast<BlockStmt>(body[0])
+          : std::make_shared<BlockStmt>(std::move(body)),
+      func.GetAttrs()
+  );
+  clones_.push_back(clone);
+  keys_.emplace(key, clone.get());
+  origins_.emplace(clone.get(), &func);
+  return clone.get();
+}
+
+// -----------------------------------------------------------------------------
+std::shared_ptr<Stmt> Specialiser::Rewrite(
+    std::vector<ConstScope> &env,
+    const Stmt &stmt)
+{
+  switch (stmt.GetKind()) {
+    case Stmt::Kind::BLOCK: {
+      return RewriteBlock(env, static_cast<const BlockStmt &>(stmt));
+    }
+    case Stmt::Kind::WHILE: {
+      auto &whileStmt = static_cast<const WhileStmt &>(stmt);
+      auto cond = Rewrite(env, whileStmt.GetCond());
+      if (cond->GetKind() == Expr::Kind::INT) {
+        if (static_cast<const IntExpr &>(*cond).GetNumber() == 0) {
+          return nullptr;
+        }
+      }
+      auto body = Rewrite(env, whileStmt.GetStmt());
+      if (!body) {
+        body = std::make_shared<BlockStmt>(BlockStmt::BlockList{});
+      }
+      return std::make_shared<WhileStmt>(cond, body);
+    }
+    case Stmt::Kind::IF: {
+      auto &ifStmt = static_cast<const IfStmt &>(stmt);
+      auto cond = Rewrite(env, ifStmt.GetCond());
+      if (cond->GetKind() == Expr::Kind::INT) {
+        // Only the branch which is taken is kept. A declaration is wrapped
+        // in a block so it does not leak into the enclosing scope.
+        const Stmt *branch = &ifStmt.GetStmt();
+        if (static_cast<const IntExpr &>(*cond).GetNumber() == 0) {
+          branch = ifStmt.GetElseStmt().get();
+        }
+        if (!branch) {
+          return nullptr;
+        }
+        env.emplace_back();
+        auto taken = Rewrite(env, *branch);
+        env.pop_back();
+        if (taken && taken->GetKind() == Stmt::Kind::LET) {
+          return std::make_shared<BlockStmt>(BlockStmt::BlockList{ taken });
+        }
+        return taken;
+      }
+      auto then = Rewrite(env, ifStmt.GetStmt());
+      if (!then) {
+        then = std::make_shared<BlockStmt>(BlockStmt::BlockList{});
+      }
+      std::shared_ptr<Stmt> otherwise;
+      if (auto elseStmt = ifStmt.GetElseStmt()) {
+        otherwise = Rewrite(env, *elseStmt);
+      }
+      return std::make_shared<IfStmt>(cond, then, otherwise);
+    }
+    case Stmt::Kind::LET: {
+      auto &letStmt = static_cast<const LetStmt &>(stmt);
+      std::shared_ptr<Expr> init;
+      if (auto expr = letStmt.GetInitialisation()) {
+        init = Rewrite(env, *expr);
+      }
+      std::string name = letStmt.GetName();
+      std::string type = letStmt.GetType();
+      env.back()[name] = std::nullopt;
+      return std::make_shared<LetStmt>(name, type, init);
+    }
+    case Stmt::Kind::ASSIGN: {
+      auto &assignStmt = static_cast<const AssignStmt &>(stmt);
+      return std::make_shared<AssignStmt>(
+          assignStmt.GetName(),
+          Rewrite(env, assignStmt.GetExpr())
+      );
+    }
+    case Stmt::Kind::EXPR: {
+      // Constants computed for no purpose are dropped.
+      auto expr = Rewrite(env, static_cast<const ExprStmt &>(stmt).GetExpr());
+      if (expr->GetKind() == Expr::Kind::INT) {
+        return nullptr;
+      }
+      return std::make_shared<ExprStmt>(expr);
+    }
+    case Stmt::Kind::RETURN: {
+      auto &retStmt = static_cast<const ReturnStmt &>(stmt);
+      return std::make_shared<ReturnStmt>(Rewrite(env, retStmt.GetExpr()));
+    }
+    case Stmt::Kind::YIELD: {
+      auto &yieldStmt = static_cast<const YieldStmt &>(stmt);
+      return std::make_shared<YieldStmt>(Rewrite(env, yieldStmt.GetExpr()));
+    }
+  }
+  return nullptr;
+}
+
+// -----------------------------------------------------------------------------
+std::shared_ptr<BlockStmt> Specialiser::RewriteBlock(
+    std::vector<ConstScope> &env,
+    const BlockStmt &block)
+{
+  BlockStmt::BlockList body;
+  env.emplace_back();
+  for (auto &stmt : block) {
+    if (auto s = Rewrite(env, *stmt)) {
+      body.push_back(s);
+    }
+    // Statements following a return are unreachable.
+    if (stmt->GetKind() == Stmt::Kind::RETURN) {
+      break;
+    }
+  }
+  env.pop_back();
+  return std::make_shared<BlockStmt>(std::move(body));
+}
+
+// -----------------------------------------------------------------------------
+std::shared_ptr<Expr> Specialiser::Rewrite(
+    const std::vector<ConstScope> &env,
+    const Expr &expr)
+{
+  switch (expr.GetKind()) {
+    case Expr::Kind::REF: {
+      auto &name = static_cast<const RefExpr &>(expr).GetName();
+      for (auto it = env.rbegin(); it != env.rend(); ++it) {
+        if (auto jt = it->find(name); jt != it->end()) {
+          if (jt->second) {
+            return exprs_.Int(*jt->second);
+          }
+          break;
+        }
+      }
+      return exprs_.Ref(name);
+    }
+    case Expr::Kind::BINARY: {
+      auto &binary = static_cast<const BinaryExpr &>(expr);
+      auto lhs = Rewrite(env, binary.GetLHS());
+      auto rhs = Rewrite(env, binary.GetRHS());
+      if (lhs->GetKind() == Expr::Kind::INT && rhs->GetKind() == Expr::Kind::INT) {
+        auto r = Fold(
+            binary.GetKind(),
+            static_cast<const IntExpr &>(*lhs).GetNumber(),
+            static_cast<const IntExpr &>(*rhs).GetNumber()
+        );
+        if (r) {
+          return exprs_.Int(*r);
+        }
+      }
+      return exprs_.Binary(binary.GetKind(), lhs, rhs);
+    }
+    case Expr::Kind::CALL: {
+      auto &call = static_cast<const CallExpr &>(expr);
+      std::vector<std::shared_ptr<Expr>> args;
+      for (auto it = call.arg_rbegin(), end = call.arg_rend(); it != end; ++it) {
+        args.push_back(Rewrite(env, **it));
+      }
+      std::reverse(args.begin(), args.end());
+      return std::make_shared<CallExpr>(
+          Rewrite(env, call.GetCallee()),
+          std::move(args)
+      );
+    }
+    case Expr::Kind::INT: {
+      return exprs_.Int(static_cast<const IntExpr &>(expr).GetNumber());
+    }
+    case Expr::Kind::FUNC: {
+      assert(!"functions creating closures are not cloned");
+      return nullptr;
+    }
+  }
+  return nullptr;
+}
+
+// -----------------------------------------------------------------------------
+std::optional<int64_t> Specialiser::Fold(
+    BinaryExpr::Kind kind,
+    int64_t lhs,
+    int64_t rhs)
+{
+  int64_t r;
+  switch (kind) {
+    case BinaryExpr::Kind::ADD: {
+      if (__builtin_add_overflow(lhs, rhs, &r)) {
+        return std::nullopt;
+      }
+      return r;
+    }
+    case BinaryExpr::Kind::SUB: {
+      if (__builtin_sub_overflow(lhs, rhs, &r)) {
+        return std::nullopt;
+      }
+      return r;
+    }
+    case BinaryExpr::Kind::MUL: {
+      if (__builtin_mul_overflow(lhs, rhs, &r)) {
+        return std::nullopt;
+      }
+      return r;
+    }
+    case BinaryExpr::Kind::DIV:
+    case BinaryExpr::Kind::MOD: {
+      if (rhs == 0 || (lhs == std::numeric_limits<int64_t>::min() && rhs == -1)) {
+        return std::nullopt;
+      }
+      return kind == BinaryExpr::Kind::DIV ? lhs / rhs : lhs % rhs;
+    }
+    case BinaryExpr::Kind::GREATER: {
+      return lhs > rhs;
+    }
+    case BinaryExpr::Kind::LOWER: {
+      return lhs < rhs;
+    }
+    case BinaryExpr::Kind::GREATER_EQ: {
+      return lhs >= rhs;
+    }
+    case BinaryExpr::Kind::LOWER_EQ: {
+      return lhs <= rhs;
+    }
+    case BinaryExpr::Kind::IS_EQ: {
+      return lhs == rhs;
+    }
+  }
+  return std::nullopt;
+}
@@ -0,0 +1,122 @@
+// This file is part of the IMP project.
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ast.h"
+#include "visitor.h"
+
+
+
+/**
+ * Specialisation of functions on constant arguments.
+ *
+ * Direct calls passing integer literals to a function are redirected to a
+ * clone of the function which takes only the remaining arguments. In the
+ * body of the clone, the constant arguments are substituted, expressions
+ * whose operands are all constants are folded, and branches and loops
+ * whose conditions become constant are removed. Calls in the bodies of
+ * clones are specialised in turn, so recursive functions with constant
+ * arguments are unfolded until the budget is exhausted.
+ *
+ * Only functions whose bodies are small enough and do not create closures
+ * are cloned, and the number of clones is bounded. Operations which would fail or overflow at run
+ * time are not folded, leaving the error to be raised by the interpreter.
+ */
+class Specialiser : private AstVisitor<Specialiser> {
+public:
+  /// Options limiting the growth of the code.
+  struct Options {
+    /// Maximal number of AST nodes in the body of a cloned function.
+    unsigned MaxSize = 64;
+    /// Maximal number of clones created for a module.
+    unsigned MaxClones = 32;
+  };
+
+public:
+  /// Creates a specialiser with a given set of options.
+  Specialiser(const Options &opts) : opts_(opts) {}
+
+  /// Finds the call sites with constant arguments and clones their targets.
+  void Run(const Module &mod);
+
+  /// Returns the clone invoked by a call, null if the call is not redirected.
+  /// Integer literals are not passed to the clone.
+  const FuncDecl *Find(const CallExpr &call) const
+  {
+    auto it = calls_.find(&call);
+    return it == calls_.end() ? nullptr : it->second;
+  }
+
+  /// Returns the clones, in the order they were created.
+  const std::vector<std::shared_ptr<FuncDecl>> &GetClones() const
+  {
+    return clones_;
+  }
+
+  /// Returns the function a clone was created from.
+  const FuncDecl &GetOriginal(const FuncDecl &clone) const
+  {
+    return *origins_.at(&clone);
+  }
+
+private:
+  friend class AstVisitor<Specialiser>;
+
+  /// Opens the scope of a block.
+  bool TraverseBlockStmt(const BlockStmt &stmt);
+  /// Declares a local after its initialiser.
+  bool TraverseLetStmt(const LetStmt &stmt);
+  /// Opens the scope of the arguments of a closure.
+  bool TraverseFuncExpr(const FuncExpr &expr);
+  /// Redirects a call with constant arguments.
+  bool VisitCallExpr(const CallExpr &call);
+
+  /// Finds a function with a body which is not shadowed by a local.
+  const FuncDecl *Resolve(const std::string &name) const;
+  /// Creates a clone, null if the budget is exhausted.
+  const FuncDecl *Specialise(
+      const FuncDecl &func,
+      const std::vector<std::optional<int64_t>> &consts);
+
+private:
+  /// Scope mapping names to constants, or to nothing if they are variables.
+  using ConstScope = std::map<std::string, std::optional<int64_t>>;
+
+  /// Substitutes constants in a statement and simplifies it. Returns null
+  /// if the statement has no effect.
+  std::shared_ptr<Stmt> Rewrite(std::vector<ConstScope> &env, const Stmt &stmt);
+  /// Substitutes constants in a block.
+  std::shared_ptr<BlockStmt> RewriteBlock(
+      std::vector<ConstScope> &env,
+      const BlockStmt &block);
+  /// Substitutes constants in an expression and folds it.
+  std::shared_ptr<Expr> Rewrite(const std::vector<ConstScope> &env, const Expr &expr);
+  /// Folds a binary operator with constant operands, if it succeeds.
+  static std::optional<int64_t> Fold(BinaryExpr::Kind kind, int64_t lhs, int64_t rhs);
+
+private:
+  /// Growth limits.
+  Options opts_;
+  /// Functions with bodies, indexed by name.
+  std::map<std::string, const FuncDecl *> funcs_;
+  /// Clones, indexed by the original function and the constant arguments.
+  std::map<std::pair<const FuncDecl *, std::vector<std::optional<int64_t>>>, const FuncDecl *> keys_;
+  /// Owned clones.
+  std::vector<std::shared_ptr<FuncDecl>> clones_;
+  /// Functions the clones were created from.
+  std::unordered_map<const FuncDecl *, const FuncDecl *> origins_;
+  /// Targets of redirected calls.
+  std::unordered_map<const CallExpr *, const FuncDecl *> calls_;
+  /// Names of arguments and locals in scope while visiting a function.
+  std::vector<std::set<std::string>> scopes_;
+  /// Factory for the expressions of the clones.
+  ExprFactory exprs_;
+};
@@ -0,0 +1,145 @@
+// This file is part of the IMP project.
+
+#include <cstring>
+
+#include "trace.h"
+#include "interp.h"
+
+
+
+// -----------------------------------------------------------------------------
+RuntimeTrace::RuntimeTrace()
+{
+  for (auto &[name, method] : kRuntimeFns) {
+    methods_.emplace(method.Fn, Method{ &name, &method });
+  }
+}
+
+// -----------------------------------------------------------------------------
+TraceRecorder::TraceRecorder(std::ostream &os)
+  : os_(os)
+{
+  os_.write(kMagic, sizeof(kMagic));
+}
+
+// -----------------------------------------------------------------------------
+void TraceRecorder::Call(Interp &interp, RuntimeFn fn)
+{
+  auto &method = Find(fn);
+  if (!method.Info->PerformsIO) {
+    (*fn) (interp);
+    return;
+  }
+
+  // Arguments are popped by the call, so they are saved beforehand.
+  std::vector<int64_t> args;
+  for (unsigned i = 0; i < method.Info->NumArgs; ++i) {
+    args.push_back(interp.Peek(i).Val.Int);
+  }
+  (*fn) (interp);
+
+  auto [it, inserted] = ids_.emplace(fn, ids_.size());
+  WriteUnsigned(it->second);
+  if (inserted) {
+    WriteUnsigned(method.Name->size());
+    os_.write(method.Name->data(), method.Name->size());
+  }
+  for (auto arg : args) {
+    WriteSigned(arg);
+  }
+  WriteSigned(interp.Peek(0).Val.Int);
+}
+
+// -----------------------------------------------------------------------------
+void TraceRecorder::WriteUnsigned(uint64_t v)
+{
+  while (v >= 0x80) {
+    os_.put(static_cast<char>(v | 0x80));
+    v >>= 7;
+  }
+  os_.put(static_cast<char>(v));
+}
+
+// -----------------------------------------------------------------------------
+void TraceRecorder::WriteSigned(int64_t v)
+{
+  auto u = static_cast<uint64_t>(v);
+  WriteUnsigned((u << 1) ^ (v < 0 ? ~0ull : 0ull));
+}
+
+// -----------------------------------------------------------------------------
+TraceReplayer::TraceReplayer(std::istream &is)
+  : is_(is)
+{
+  char magic[sizeof(kMagic)];
+  if (!is_.read(magic, sizeof(magic)) || memcmp(magic, kMagic, sizeof(magic))) {
+    throw TraceError("not a replay log");
+  }
+}
+
+// -----------------------------------------------------------------------------
+void TraceReplayer::Call(Interp &interp, RuntimeFn fn)
+{
+  auto &method = Find(fn);
+  if (!method.Info->PerformsIO) {
+    (*fn) (interp);
+    return;
+  }
+
+  ++calls_;
+  if (is_.peek() == std::istream::traits_type::eof()) {
+    Diverge("log exhausted");
+  }
+  auto id = ReadUnsigned();
+  if (id == names_.size()) {
+    std::string name(ReadUnsigned(), '\0');
+    if (!is_.read(name.data(), name.size())) {
+      throw TraceError("truncated replay log");
+    }
+    names_.push_back(name);
+  }
+  if (id >= names_.size()) {
+    throw TraceError("invalid method index in replay log");
+  }
+  if (names_[id] != *method.Name) {
+    Diverge("expected '" + names_[id] + "', got '" + *method.Name + "'");
+  }
+
+  // Arguments must match the recorded ones, so that outputs are the same.
+  for (unsigned i = 0; i < method.Info->NumArgs; ++i) {
+    if (interp.Pop().Val.Int != ReadSigned()) {
+      Diverge("argument mismatch in '" + *method.Name + "'");
+    }
+  }
+  interp.Push<int64_t>(ReadSigned());
+}
+
+// -----------------------------------------------------------------------------
+uint64_t TraceReplayer::ReadUnsigned()
+{
+  uint64_t v = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7) {
+    auto c = is_.get();
+    if (c == std::istream::traits_type::eof()) {
+      throw TraceError("truncated replay log");
+    }
+    v |= static_cast<uint64_t>(c & 0x7f) << shift;
+    if ((c & 0x80) == 0) {
+      return v;
+    }
+  }
+  throw TraceError("malformed integer in replay log");
+}
+
+// -----------------------------------------------------------------------------
+int64_t TraceReplayer::ReadSigned()
+{
+  auto u = ReadUnsigned();
+  return static_cast<int64_t>((u >> 1) ^ (0ull - (u & 1)));
+}
+
+// -----------------------------------------------------------------------------
+void TraceReplayer::Diverge(const std::string &msg)
+{
+  throw TraceError("replay diverged at call " + std::to_string(calls_) + ": " + msg);
+}
@@ -0,0 +1,115 @@
+// This file is part of the IMP project.
+
+#pragma once
+
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "runtime.h"
+
+class Interp;
+
+
+
+/**
+ * Intercepts the calls to runtime methods made by the interpreter.
+ *
+ * Calls to methods which perform I/O are logged by the recorder and fed
+ * back by the replayer, while the other methods are always executed, as
+ * they are deterministic given the values logged for the I/O.
+ *
+ * The log starts with a magic number, followed by one entry for each call:
+ * the index of the method, then its arguments and its result. Indices are
+ * assigned in the order methods are first called, with the first entry of
+ * a method also carrying its name. All integers are encoded as variable
+ * length quantities, signed ones in zig-zag form.
+ */
+class RuntimeTrace {
+public:
+  RuntimeTrace();
+  virtual ~RuntimeTrace() = default;
+
+  /// Invokes a runtime method on behalf of the interpreter.
+  virtual void Call(Interp &interp, RuntimeFn fn) = 0;
+
+protected:
+  /// Descriptor of a runtime method, along with its name.
+  struct Method {
+    const std::string *Name;
+    const RuntimeMethod *Info;
+  };
+
+  /// Finds the descriptor of a runtime method.
+  const Method &Find(RuntimeFn fn) const { return methods_.at(fn); }
+
+  /// Magic number identifying logs.
+  static constexpr char kMagic[4] = { 'I', 'M', 'P', 'R' };
+
+private:
+  /// Descriptors of all runtime methods, by implementation.
+  std::unordered_map<RuntimeFn, Method> methods_;
+};
+
+/**
+ * Represents a log which cannot be replayed.
+ */
+class TraceError : public std::runtime_error {
+public:
+  TraceError(const std::string &msg) : std::runtime_error(msg) {}
+};
+
+/**
+ * Writes the I/O of a run to a log.
+ */
+class TraceRecorder final : public RuntimeTrace {
+public:
+  /// Starts a log written to a binary stream.
+  TraceRecorder(std::ostream &os);
+
+  void Call(Interp &interp, RuntimeFn fn) override;
+
+private:
+  /// Writes an unsigned integer.
+  void WriteUnsigned(uint64_t v);
+  /// Writes a signed integer.
+  void WriteSigned(int64_t v);
+
+private:
+  /// Stream receiving the log.
+  std::ostream &os_;
+  /// Indices assigned to the methods called so far.
+  std::unordered_map<RuntimeFn, uint64_t> ids_;
+};
+
+/**
+ * Feeds the I/O of a recorded run back to the program.
+ */
+class TraceReplayer final : public RuntimeTrace {
+public:
+  /// Opens a log read from a binary stream.
+  TraceReplayer(std::istream &is);
+
+  void Call(Interp &interp, RuntimeFn fn) override;
+
+private:
+  /// Reads an unsigned integer.
+  uint64_t ReadUnsigned();
+  /// Reads a signed integer.
+  int64_t ReadSigned();
+
+  /// Reports a call which does not match the log.
+  [[noreturn]] void Diverge(const std::string &msg);
+
+private:
+  /// Stream providing the log.
+  std::istream &is_;
+  /// Names of the methods, by index.
+  std::vector<std::string> names_;
+  /// Number of calls replayed so far.
+  uint64_t calls_ = 0;
+};
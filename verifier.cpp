@@ -2,10 +2,171 @@
 
 #include "verifier.h"
 #include "ast.h"
+#include "callgraph.h"
+#include "runtime.h"
+#include "visitor.h"
 
 
 
+/**
+ * Checks that assignments target arguments or locals in scope. Closures
+ * hold copies of the variables they capture, which cannot be assigned.
+ */
+class AssignChecker final : public AstVisitor<AssignChecker> {
+public:
+  /// Checks the body of a function, with its arguments in scope.
+  void CheckFunc(const FuncDecl &decl)
+  {
+    scopes_.emplace_back();
+    for (auto it = decl.arg_begin(), end = decl.arg_end(); it != end; ++it) {
+      scopes_.back().insert(it->first);
+    }
+    TraverseFuncDecl(decl);
+    scopes_.pop_back();
+  }
+
+  /// Checks a top-level statement.
+  void CheckStmt(const Stmt &stmt)
+  {
+    scopes_.emplace_back();
+    TraverseStmt(stmt);
+    scopes_.pop_back();
+  }
+
+  bool TraverseBlockStmt(const BlockStmt &stmt)
+  {
+    scopes_.emplace_back();
+    AstVisitor::TraverseBlockStmt(stmt);
+    scopes_.pop_back();
+    return true;
+  }
+
+  bool TraverseLetStmt(const LetStmt &stmt)
+  {
+    AstVisitor::TraverseLetStmt(stmt);
+    scopes_.back().insert(stmt.GetName());
+    return true;
+  }
+
+  bool TraverseFuncExpr(const FuncExpr &expr)
+  {
+    auto &decl = expr.GetDecl();
+    auto closure = closure_;
+    closure_ = scopes_.size();
+    scopes_.emplace_back();
+    for (auto it = decl.arg_begin(), end = decl.arg_end(); it != end; ++it) {
+      scopes_.back().insert(it->first);
+    }
+    AstVisitor::TraverseFuncExpr(expr);
+    scopes_.pop_back();
+    closure_ = closure;
+    return true;
+  }
+
+  bool VisitAssignStmt(const AssignStmt &stmt)
+  {
+    for (size_t i = scopes_.size(); i-- > 0; ) {
+      if (!scopes_[i].count(stmt.GetName())) {
+        continue;
+      }
+      if (i < closure_) {
+        throw VerifierError("cannot assign to captured '" + stmt.GetName() + "'");
+      }
+      return true;
+    }
+    throw VerifierError("cannot assign to '" + stmt.GetName() + "'");
+  }
+
+private:
+  /// Names of arguments and locals in scope.
+  std::vector<std::set<std::string>> scopes_;
+  /// Index of the first scope of the innermost closure.
+  size_t closure_ = 0;
+};
+
+/**
+ * Checks that top-level statements do not yield, outside of closures.
+ */
+class YieldChecker final : public AstVisitor<YieldChecker> {
+public:
+  bool TraverseFuncExpr(const FuncExpr &)
+  {
+    // Closures which yield are generators.
+    return true;
+  }
+
+  bool VisitYieldStmt(const YieldStmt &)
+  {
+    throw VerifierError("yield outside of a function");
+  }
+};
+
+// -----------------------------------------------------------------------------
+static void VerifyAttrs(const FuncOrProtoDecl &decl)
+{
+  using Attr = FuncOrProtoDecl::Attr;
+  if (decl.HasAttr(Attr::HOT) && decl.HasAttr(Attr::COLD)) {
+    throw VerifierError("'" + decl.GetName() + "' cannot be both @hot and @cold");
+  }
+}
+
 // -----------------------------------------------------------------------------
 void Verifier::Verify(const Module &stat)
 {
+  for (auto item : stat) {
+    if (auto *proto = std::get_if<std::shared_ptr<ProtoDecl>>(&item)) {
+      // Prototypes must match the methods provided by the runtime.
+      auto &decl = **proto;
+      auto &prim = decl.GetPrimitiveName();
+      auto it = kRuntimeFns.find(prim);
+      if (it == kRuntimeFns.end()) {
+        throw VerifierError("unknown runtime method '" + prim + "'");
+      }
+      if (decl.arg_size() != it->second.NumArgs) {
+        throw VerifierError(
+            "prototype '" + decl.GetName() + "' expects " +
+            std::to_string(it->second.NumArgs) + " arguments"
+        );
+      }
+      if (decl.HasAttr(FuncOrProtoDecl::Attr::PURE) && !it->second.IsPure) {
+        throw VerifierError(
+            "prototype '" + decl.GetName() + "' is declared @pure, " +
+            "but '" + prim + "' has side effects"
+        );
+      }
+      VerifyAttrs(decl);
+    }
+    if (auto *func = std::get_if<std::shared_ptr<FuncDecl>>(&item)) {
+      VerifyAttrs(**func);
+      VerifyFunc(**func);
+    }
+    if (auto *stmt = std::get_if<std::shared_ptr<Stmt>>(&item)) {
+      AssignChecker().CheckStmt(**stmt);
+      YieldChecker().TraverseStmt(**stmt);
+    }
+  }
+
+  // Pure functions can only call other pure functions.
+  CallGraph graph(stat);
+  for (auto &[name, node] : graph) {
+    if (!node.Func || !node.IsPure) {
+      continue;
+    }
+    if (node.HasIndirectCalls) {
+      throw VerifierError("pure function '" + name + "' makes indirect calls");
+    }
+    for (auto &callee : node.Callees) {
+      if (!graph.Find(callee)->IsPure) {
+        throw VerifierError(
+            "pure function '" + name + "' calls impure '" + callee + "'"
+        );
+      }
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+void Verifier::VerifyFunc(const FuncDecl &func)
+{
+  AssignChecker().CheckFunc(func);
 }
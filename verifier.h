@@ -2,10 +2,24 @@
 
 #pragma once
 
+#include <stdexcept>
+#include <string>
 
+
+class FuncDecl;
 class Module;
 
+/**
+ * Represents a semantic error in the program.
+ */
+class VerifierError : public std::runtime_error {
+public:
+  VerifierError(const std::string &msg) : std::runtime_error(msg) {}
+};
+
 class Verifier {
 public:
   void Verify(const Module &stat);
+  /// Checks the body of a function parsed after its module was verified.
+  void VerifyFunc(const FuncDecl &func);
 };
@@ -0,0 +1,323 @@
+// This file is part of the IMP project.
+
+#pragma once
+
+#include <set>
+#include <string>
+
+#include "ast.h"
+
+
+
+/**
+ * Static visitor over the functions, statements and expressions of the AST.
+ *
+ * Passes derive from the template, passing their own type as the argument,
+ * and redefine the methods they want to customise. Calls are dispatched at
+ * compile time, so they can be inlined and no virtual methods are needed.
+ *
+ * The Traverse methods walk a node and its children, invoking the Visit
+ * hooks of the node before descending. The generic VisitStmt and VisitExpr
+ * hooks are invoked on all nodes, before the specific ones. Traversals can
+ * be redefined to handle scopes or to skip some of the children, calling
+ * the implementation of the base class to continue the default walk.
+ *
+ * All methods return false to stop the traversal early, in which case the
+ * outermost traversal returns false as well.
+ */
+template <typename Derived>
+class AstVisitor {
+public:
+  /// Traverses the functions and the top-level statements of a module.
+  bool TraverseModule(const Module &mod);
+  /// Traverses the body of a function, if it was parsed.
+  bool TraverseFuncDecl(const FuncDecl &decl);
+
+  /// Dispatches a statement to the traversal of its kind.
+  bool TraverseStmt(const Stmt &stmt);
+  /// Dispatches an expression to the traversal of its kind.
+  bool TraverseExpr(const Expr &expr);
+
+  bool TraverseBlockStmt(const BlockStmt &stmt);
+  bool TraverseWhileStmt(const WhileStmt &stmt);
+  bool TraverseIfStmt(const IfStmt &stmt);
+  bool TraverseLetStmt(const LetStmt &stmt);
+  bool TraverseAssignStmt(const AssignStmt &stmt);
+  bool TraverseExprStmt(const ExprStmt &stmt);
+  bool TraverseReturnStmt(const ReturnStmt &stmt);
+  bool TraverseYieldStmt(const YieldStmt &stmt);
+
+  bool TraverseRefExpr(const RefExpr &expr);
+  bool TraverseBinaryExpr(const BinaryExpr &expr);
+  /// Traverses the arguments in reverse order, followed by the callee.
+  bool TraverseCallExpr(const CallExpr &expr);
+  bool TraverseIntExpr(const IntExpr &expr);
+  /// Traverses the body of a closure.
+  bool TraverseFuncExpr(const FuncExpr &expr);
+
+  bool VisitFuncDecl(const FuncDecl &) { return true; }
+  bool VisitStmt(const Stmt &) { return true; }
+  bool VisitExpr(const Expr &) { return true; }
+
+  bool VisitBlockStmt(const BlockStmt &) { return true; }
+  bool VisitWhileStmt(const WhileStmt &) { return true; }
+  bool VisitIfStmt(const IfStmt &) { return true; }
+  bool VisitLetStmt(const LetStmt &) { return true; }
+  bool VisitAssignStmt(const AssignStmt &) { return true; }
+  bool VisitExprStmt(const ExprStmt &) { return true; }
+  bool VisitReturnStmt(const ReturnStmt &) { return true; }
+  bool VisitYieldStmt(const YieldStmt &) { return true; }
+
+  bool VisitRefExpr(const RefExpr &) { return true; }
+  bool VisitBinaryExpr(const BinaryExpr &) { return true; }
+  bool VisitCallExpr(const CallExpr &) { return true; }
+  bool VisitIntExpr(const IntExpr &) { return true; }
+  bool VisitFuncExpr(const FuncExpr &) { return true; }
+
+private:
+  /// Returns the pass derived from the visitor.
+  Derived &Self() { return *static_cast<Derived *>(this); }
+};
+
+// -----------------------------------------------------------------------------
+template <typename Derived>
+bool AstVisitor<Derived>::TraverseModule(const Module &mod)
+{
+  for (auto item : mod) {
+    if (auto *func = std::get_if<std::shared_ptr<FuncDecl>>(&item)) {
+      if (!Self().TraverseFuncDecl(**func)) {
+        return false;
+      }
+    }
+    if (auto *stmt = std::get_if<std::shared_ptr<Stmt>>(&item)) {
+      if (!Self().TraverseStmt(**stmt)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+template <typename Derived>
+bool AstVisitor<Derived>::TraverseFuncDecl(const FuncDecl &decl)
+{
+  if (!Self().VisitFuncDecl(decl)) {
+    return false;
+  }
+  return !decl.HasBody() || Self().TraverseStmt(decl.GetBody());
+}
+
+// -----------------------------------------------------------------------------
+template <typename Derived>
+bool AstVisitor<Derived>::TraverseStmt(const Stmt &stmt)
+{
+  if (!Self().VisitStmt(stmt)) {
+    return false;
+  }
+  switch (stmt.GetKind()) {
+    case Stmt::Kind::BLOCK: {
+      return Self().TraverseBlockStmt(static_cast<const BlockStmt &>(stmt));
+    }
+    case Stmt::Kind::WHILE: {
+      return Self().TraverseWhileStmt(static_cast<const WhileStmt &>(stmt));
+    }
+    case Stmt::Kind::IF: {
+      return Self().TraverseIfStmt(static_cast<const IfStmt &>(stmt));
+    }
+    case Stmt::Kind::LET: {
+      return Self().TraverseLetStmt(static_cast<const LetStmt &>(stmt));
+    }
+    case Stmt::Kind::ASSIGN: {
+      return Self().TraverseAssignStmt(static_cast<const AssignStmt &>(stmt));
+    }
+    case Stmt::Kind::EXPR: {
+      return Self().TraverseExprStmt(static_cast<const ExprStmt &>(stmt));
+    }
+    case Stmt::Kind::RETURN: {
+      return Self().TraverseReturnStmt(static_cast<const ReturnStmt &>(stmt));
+    }
+    case Stmt::Kind::YIELD: {
+      return Self().TraverseYieldStmt(static_cast<const YieldStmt &>(stmt));
+    }
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+template <typename Derived>
+bool AstVisitor<Derived>::TraverseExpr(const Expr &expr)
+{
+  if (!Self().VisitExpr(expr)) {
+    return false;
+  }
+  switch (expr.GetKind()) {
+    case Expr::Kind::REF: {
+      return Self().TraverseRefExpr(static_cast<const RefExpr &>(expr));
+    }
+    case Expr::Kind::BINARY: {
+      return Self().TraverseBinaryExpr(static_cast<const BinaryExpr &>(expr));
+    }
+    case Expr::Kind::CALL: {
+      return Self().TraverseCallExpr(static_cast<const CallExpr &>(expr));
+    }
+    case Expr::Kind::INT: {
+      return Self().TraverseIntExpr(static_cast<const IntExpr &>(expr));
+    }
+    case Expr::Kind::FUNC: {
+      return Self().TraverseFuncExpr(static_cast<const FuncExpr &>(expr));
+    }
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+template <typename Derived>
+bool AstVisitor<Derived>::TraverseBlockStmt(const BlockStmt &stmt)
+{
+  if (!Self().VisitBlockStmt(stmt)) {
+    return false;
+  }
+  for (auto &s : stmt) {
+    if (!Self().TraverseStmt(*s)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+template <typename Derived>
+bool AstVisitor<Derived>::TraverseWhileStmt(const WhileStmt &stmt)
+{
+  return Self().VisitWhileStmt(stmt)
+      && Self().TraverseExpr(stmt.GetCond())
+      && Self().TraverseStmt(stmt.GetStmt());
+}
+
+// -----------------------------------------------------------------------------
+template <typename Derived>
+bool AstVisitor<Derived>::TraverseIfStmt(const IfStmt &stmt)
+{
+  if (!Self().VisitIfStmt(stmt)) {
+    return false;
+  }
+  if (!Self().TraverseExpr(stmt.GetCond()) || !Self().TraverseStmt(stmt.GetStmt())) {
+    return false;
+  }
+  auto elseStmt = stmt.GetElseStmt();
+  return !elseStmt || Self().TraverseStmt(*elseStmt);
+}
+
+// -----------------------------------------------------------------------------
+template <typename Derived>
+bool AstVisitor<Derived>::TraverseLetStmt(const LetStmt &stmt)
+{
+  if (!Self().VisitLetStmt(stmt)) {
+    return false;
+  }
+  auto init = stmt.GetInitialisation();
+  return !init || Self().TraverseExpr(*init);
+}
+
+// -----------------------------------------------------------------------------
+template <typename Derived>
+bool AstVisitor<Derived>::TraverseAssignStmt(const AssignStmt &stmt)
+{
+  return Self().VisitAssignStmt(stmt) && Self().TraverseExpr(stmt.GetExpr());
+}
+
+// -----------------------------------------------------------------------------
+template <typename Derived>
+bool AstVisitor<Derived>::TraverseExprStmt(const ExprStmt &stmt)
+{
+  return Self().VisitExprStmt(stmt) && Self().TraverseExpr(stmt.GetExpr());
+}
+
+// -----------------------------------------------------------------------------
+template <typename Derived>
+bool AstVisitor<Derived>::TraverseReturnStmt(const ReturnStmt &stmt)
+{
+  return Self().VisitReturnStmt(stmt) && Self().TraverseExpr(stmt.GetExpr());
+}
+
+// -----------------------------------------------------------------------------
+template <typename Derived>
+bool AstVisitor<Derived>::TraverseYieldStmt(const YieldStmt &stmt)
+{
+  return Self().VisitYieldStmt(stmt) && Self().TraverseExpr(stmt.GetExpr());
+}
+
+// -----------------------------------------------------------------------------
+template <typename Derived>
+bool AstVisitor<Derived>::TraverseRefExpr(const RefExpr &expr)
+{
+  return Self().VisitRefExpr(expr);
+}
+
+// -----------------------------------------------------------------------------
+template <typename Derived>
+bool AstVisitor<Derived>::TraverseBinaryExpr(const BinaryExpr &expr)
+{
+  return Self().VisitBinaryExpr(expr)
+      && Self().TraverseExpr(expr.GetLHS())
+      && Self().TraverseExpr(expr.GetRHS());
+}
+
+// -----------------------------------------------------------------------------
+template <typename Derived>
+bool AstVisitor<Derived>::TraverseCallExpr(const CallExpr &expr)
+{
+  if (!Self().VisitCallExpr(expr)) {
+    return false;
+  }
+  for (auto it = expr.arg_rbegin(), end = expr.arg_rend(); it != end; ++it) {
+    if (!Self().TraverseExpr(**it)) {
+      return false;
+    }
+  }
+  return Self().TraverseExpr(expr.GetCallee());
+}
+
+// -----------------------------------------------------------------------------
+template <typename Derived>
+bool AstVisitor<Derived>::TraverseIntExpr(const IntExpr &expr)
+{
+  return Self().VisitIntExpr(expr);
+}
+
+// -----------------------------------------------------------------------------
+template <typename Derived>
+bool AstVisitor<Derived>::TraverseFuncExpr(const FuncExpr &expr)
+{
+  return Self().VisitFuncExpr(expr)
+      && Self().TraverseStmt(expr.GetDecl().GetBody());
+}
+
+/**
+ * Counts the statements and expressions of a subtree.
+ */
+class NodeCounter final : public AstVisitor<NodeCounter> {
+public:
+  bool VisitStmt(const Stmt &) { ++Count; return true; }
+  bool VisitExpr(const Expr &) { ++Count; return true; }
+
+  unsigned Count = 0;
+};
+
+/**
+ * Collects the names of the variables which are assigned in a subtree.
+ */
+class AssignFinder final : public AstVisitor<AssignFinder> {
+public:
+  AssignFinder(std::set<std::string> &names) : names_(names) {}
+
+  bool VisitAssignStmt(const AssignStmt &stmt)
+  {
+    names_.insert(stmt.GetName());
+    return true;
+  }
+
+private:
+  std::set<std::string> &names_;
+};